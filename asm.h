@@ -2,17 +2,34 @@
 #ifndef ASM_H
 #define ASM_H
 
+#include <stdint.h>
+
+/* See x64.c for the guest calling convention */
+
 void* asm_prologue(void* pgm);
-void* asm_epilogue(void* pgm);
+void* asm_epilogue(void* pgm, int tail);
+
+void* asm_profile_prologue(void* pgm, uint64_t* calls);
+void* asm_profile_epilogue(void* pgm, uint64_t* cycles, int tail);
+
+void* asm_guest_call(void* pgm);
+void* asm_guest_return(void* pgm);
 
 void* asm_call(void* pgm, const void* function);
+void* asm_jmp(void* pgm, const void* function);
 void* asm_ret(void* pgm);
 
-void asm_patch_call(void* call, const void* function);
+int asm_patch_call(void* call, const void* function);
+const void* asm_call_target(const void* call);
+void* asm_find_call(void* return_address, const void* function);
 
-void* asm_integer(void* pgm, long l);
+#define ASM_VENEER_SIZE 14
 
-/*
+void* asm_veneer(void* pgm, const void* function);
+
+void* asm_resolver_stub(void* pgm, const void* context, const void* resolver);
+
+void* asm_integer(void* pgm, long l);
 
 void* asm_pop(void* pgm);
 void* asm_dup(void* pgm);
@@ -21,8 +38,39 @@ void* asm_swap(void* pgm);
 void* asm_add(void* pgm);
 void* asm_sub(void* pgm);
 void* asm_mul(void* pgm);
-void* asm_div(void* pgm);
 
-*/
+/* Scratch registers, see x64.c */
+
+#define ASM_SCRATCH_REGISTERS 8
+
+void* asm_reg_imm(void* pgm, int reg, long l);
+void* asm_reg_mov(void* pgm, int dst, int src);
+void* asm_reg_load(void* pgm, int reg, int slot);
+void* asm_reg_store(void* pgm, int slot, int reg);
+void* asm_adjust(void* pgm, int slots);
+
+void* asm_reg_add(void* pgm, int dst, int src);
+void* asm_reg_sub(void* pgm, int dst, int src);
+void* asm_reg_mul(void* pgm, int dst, int src);
+
+/* These need imm to fit in a sign-extended 32-bit immediate */
+
+void* asm_add_imm(void* pgm, long imm);
+void* asm_sub_imm(void* pgm, long imm);
+
+void* asm_reg_add_imm(void* pgm, int reg, long imm);
+void* asm_reg_sub_imm(void* pgm, int reg, long imm);
+void* asm_reg_mul_imm(void* pgm, int reg, long imm);
+
+/* Branches within a definition, see x64.c */
+
+void* asm_jump(void* pgm);
+void* asm_jump_if_zero(void* pgm, int reg);
+void* asm_jump_if_nonzero(void* pgm, int reg);
+int asm_patch_jump(void* end, const void* target);
+
+void* asm_loop_start(void* pgm, int reg);
+void* asm_loop_next(void* pgm);
+void* asm_loop_end(void* pgm);
 
 #endif
@@ -0,0 +1,155 @@
+#!/bin/sh
+# Benchmarks for the reader, the compiler and the runtime.
+#
+# Usage: bench/run.sh [path to simple] [extra options for simple...]
+#
+# Every result is a line of the form
+#
+#   bench <name> <value> <unit>
+#
+# on stdout, so runs can be compared with diff or a spreadsheet. Set
+# BENCH_SCALE to make everything bigger or smaller (default 1) and BENCH_RUNS
+# to change how many times each benchmark runs (the fastest run is reported).
+
+set -e
+
+SIMPLE=${1:-./simple}
+[ $# -gt 0 ] && shift
+OPTIONS="$*"
+
+SCALE=${BENCH_SCALE:-1}
+RUNS=${BENCH_RUNS:-3}
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/simple-bench.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+now_ns() {
+  date +%s%N
+}
+
+time_ns() {
+  # Runs simple on the given files RUNS times and prints the fastest time
+  best=
+  run=0
+  while [ $run -lt "$RUNS" ]; do
+    start=$(now_ns)
+    "$SIMPLE" $OPTIONS "$@" > /dev/null
+    end=$(now_ns)
+    elapsed=$((end - start))
+    if [ -z "$best" ] || [ $elapsed -lt "$best" ]; then
+      best=$elapsed
+    fi
+    run=$((run + 1))
+  done
+  echo "$best"
+}
+
+report() {
+  # report <name> <value> <unit>
+  echo "bench $1 $2 $3"
+}
+
+rate() {
+  # rate <count> <ns>: count per second
+  awk -v n="$1" -v ns="$2" 'BEGIN { printf "%.0f", (ns > 0 ? n * 1e9 / ns : 0) }'
+}
+
+per() {
+  # per <ns> <count>: nanoseconds each
+  awk -v n="$2" -v ns="$1" 'BEGIN { printf "%.2f", (n > 0 ? ns / n : 0) }'
+}
+
+: > "$WORK/empty.smp"
+startup=$(time_ns "$WORK/empty.smp")
+report startup "$startup" ns
+
+# Reader throughput: lots of cheap top-level forms, so the time goes into
+# reading rather than running them
+
+forms=$((200000 * SCALE))
+awk -v n=$forms 'BEGIN {
+  print "DEFVAL SOME-VALUE 0 DONE"
+  for (i = 0; i < n; ++i) {
+    printf "%d SOME-VALUE \"string %d\" DROP DROP DROP\n", i * 7919, i
+  }
+}' > "$WORK/reader.smp"
+
+bytes=$(wc -c < "$WORK/reader.smp")
+elapsed=$(time_ns "$WORK/reader.smp")
+elapsed=$((elapsed - startup))
+report reader-bytes "$(rate "$bytes" "$elapsed")" bytes/s
+report reader-forms "$(rate $((forms * 6)) "$elapsed")" forms/s
+
+# Compile throughput: many DEFUN bodies, none of which ever run
+
+defs=$((20000 * SCALE))
+awk -v n=$defs 'BEGIN {
+  print "DEFUN SQ DUP * DONE"
+  for (i = 0; i < n; ++i) {
+    printf "DEFUN F%d %d SQ 3 + DUP * SWAP DROP %d - SQ F%d DUP PRINTI DROP DONE\n", i, i, i, i
+  }
+}' > "$WORK/compile.smp"
+
+elapsed=$(time_ns "$WORK/compile.smp")
+elapsed=$((elapsed - startup))
+report compile-defuns "$(rate "$defs" "$elapsed")" defuns/s
+
+# Symbol lookup as the table grows: define N values, then look names up at
+# the top level. The time for just defining them is subtracted.
+
+lookups=$((200000 * SCALE))
+for size in 100 10000 100000; do
+  awk -v n=$size 'BEGIN { for (i = 0; i < n; ++i) printf "DEFVAL V%d %d DONE\n", i, i }' > "$WORK/symbols-$size.smp"
+  awk -v n=$size -v m=$lookups 'BEGIN {
+    srand(1)
+    for (i = 0; i < m; ++i) printf "V%d DROP\n", int(rand() * n)
+  }' > "$WORK/lookups-$size.smp"
+
+  define=$(time_ns "$WORK/symbols-$size.smp")
+  elapsed=$(time_ns "$WORK/symbols-$size.smp" "$WORK/lookups-$size.smp")
+  report "lookup-$size" "$(per $((elapsed - define)) "$lookups")" ns/lookup
+done
+
+# Calls: the same word called from the top level, where each call goes through
+# eval and call_guest_function, and from compiled code
+
+calls=$((100000 * SCALE))
+awk -v n=$calls 'BEGIN {
+  print "DEFUN NOTHING DONE"
+  for (i = 0; i < n; ++i) print "NOTHING"
+}' > "$WORK/calls-guest.smp"
+
+awk -v n=$calls 'BEGIN {
+  print "DEFUN NOTHING DONE"
+  printf "DEFUN HUNDRED"
+  for (i = 0; i < 100; ++i) printf " NOTHING"
+  print " 1 + DONE"
+}' > "$WORK/calls-define.smp"
+
+# HUNDRED ends in an add on the stack it's handed, which the peephole can't
+# drop, so its last NOTHING stays a call rather than becoming a tail jump
+awk -v n=$((calls * 10)) 'BEGIN {
+  print "0"
+  for (i = 0; i < n / 100; ++i) print "HUNDRED"
+  print "DROP"
+}' > "$WORK/calls-jit.smp"
+
+baseline=$(time_ns "$WORK/calls-define.smp")
+elapsed=$(time_ns "$WORK/calls-guest.smp")
+report call-from-eval "$(per $((elapsed - startup)) "$calls")" ns/call
+
+elapsed=$(time_ns "$WORK/calls-define.smp" "$WORK/calls-jit.smp")
+report call-from-jit "$(per $((elapsed - baseline)) $((calls * 10)))" ns/call
+
+# Kernels timed from inside with BENCH, which leaves out startup, reading and
+# compiling and prints its own bench lines
+
+iterations=$((1000000 * SCALE))
+cat > "$WORK/kernels.smp" <<END
+DEFUN NOTHING DONE
+DEFUN SQ DUP * DONE
+"kernel-call" $iterations [ NOTHING ] BENCH
+"kernel-arith" $iterations [ 7 SQ 3 + SQ DROP ] BENCH
+"kernel-times" $((iterations / 100)) [ 0 100 [ 1 + ] TIMES DROP ] BENCH
+END
+
+"$SIMPLE" $OPTIONS "$WORK/kernels.smp"
@@ -108,27 +108,66 @@ int x[] = {
 
 */
 
+#define _GNU_SOURCE // for pthread_getattr_np
+
 #include <ctype.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <poll.h>
+#include <ucontext.h>
 
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <immintrin.h>
 
 #include "x64.h"
 #include "asm.h"
 
 /* Fatal error function */
 
+/* An error ends the process, except on a worker thread with -j, where it only
+ * ends the script the worker was running; see job_run. */
+static __thread sigjmp_buf* error_handler;
+static __thread FILE* error_output; // stderr if NULL
+
+static void output_flush_current(void);
+
 static void error(const char* const msg, ...) {
+  FILE* const out = error_output ? error_output : stderr;
+
+  // so that what was printed before the error comes out before it
+  output_flush_current();
+
   va_list ap;
   va_start(ap, msg);
-  vfprintf(stderr, msg, ap);
+  vfprintf(out, msg, ap);
   va_end(ap);
 
-  fputc('\n', stderr);
+  fputc('\n', out);
+
+  if (error_handler) {
+    siglongjmp(*error_handler, 1);
+  }
 
   exit(1);
 }
@@ -146,26 +185,30 @@ static void slist_push(struct slist* const list, struct slist* new_node) {
   new_node->next = list;
 }
 
-typedef int(*slist_find_pred)(const void*, const void*);
+/** Stack **/
+
+/* Stacks are mmapped with PROT_NONE guard regions on both sides, so running
+ * off either end faults instead of corrupting memory; see stack_fault. Pages
+ * are only committed as the stack reaches them, so a big stack costs nothing
+ * until it's used. */
 
-static void* slist_find(struct slist* list, const slist_find_pred pred, const void* const context) {
-  while (list) {
-    if (pred(list, context)) {
-      return list;
-    }
+#define STACK_GUARD_SIZE (64 * 1024)
 
-    list = list->next;
-  }
+static void stack_new(void*** const base, void*** const top, const size_t size) {
+  /* size is in bytes */
 
-  return NULL;
-}
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t length = (size + page - 1) & ~(page - 1);
 
-/** Stack **/
+  char* const mem = mmap(NULL, length + 2 * STACK_GUARD_SIZE, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (mem == MAP_FAILED || mprotect(mem + STACK_GUARD_SIZE, length, PROT_READ | PROT_WRITE) != 0) {
+    error("Failed to allocate a %lu byte stack: %s", (unsigned long)length, strerror(errno));
+  }
 
-static void stack_new(void*** const base, void*** const top, size_t initial_size) {
-  *base = calloc(sizeof(*base), initial_size);
-  *top = *base + initial_size - 1;
-  *top = (void*)((uintptr_t)*top & ~15ULL); // 16-byte alignment for the stack
+  *base = (void**)(mem + STACK_GUARD_SIZE);
+  *top = (void**)(mem + STACK_GUARD_SIZE + length); // page aligned, so 16-byte aligned too
 }
 
 static void stack_push(void*** const s, void* const value) {
@@ -179,6 +222,46 @@ static void* stack_pop(void*** const s) {
   return val;
 }
 
+/** Allocation counters **/
+
+/* What's been allocated where, for MEMSTATS and --memstats. Only the paths
+ * that go to malloc count, so bump allocation out of an arena costs nothing
+ * extra. Workers share the counters, hence the atomics. */
+
+enum memstat_site {
+  memstat_vector,
+  memstat_arena,
+  memstat_atom,
+  memstat_symbol,
+  memstat_call_site,
+  memstat_guest,
+  memstat_sites,
+};
+
+static const char* const memstat_names[memstat_sites] = {
+  [memstat_vector]    = "vectors",
+  [memstat_arena]     = "arena chunks",
+  [memstat_atom]      = "atoms",
+  [memstat_symbol]    = "symbols",
+  [memstat_call_site] = "call sites",
+  [memstat_guest]     = "ALLOC",
+};
+
+struct memstat {
+  size_t allocations, bytes, freed;
+};
+
+static struct memstat memstats[memstat_sites];
+
+static inline void memstat_note(const enum memstat_site site, const size_t bytes) {
+  __atomic_fetch_add(&memstats[site].allocations, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&memstats[site].bytes, bytes, __ATOMIC_RELAXED);
+}
+
+static inline void memstat_forget(const enum memstat_site site, const size_t bytes) {
+  __atomic_fetch_add(&memstats[site].freed, bytes, __ATOMIC_RELAXED);
+}
+
 /** Vector **/
 
 struct vector {
@@ -193,6 +276,7 @@ static void vector_new(struct vector* const vec) {
 }
 
 static void vector_delete(struct vector* const vec) {
+  memstat_forget(memstat_vector, vec->size);
   free(vec->data);
   vec->data = NULL;
   vec->fill = 0;
@@ -212,6 +296,7 @@ static void* vector_append(struct vector* const vec, const size_t size) {
   const size_t newfill = vec->fill + size;
 
   if (newfill > vec->size) {
+    memstat_note(memstat_vector, newfill * 2 - vec->size);
     vec->size = newfill * 2;
     vec->data = realloc(vec->data, vec->size);
 
@@ -237,9 +322,114 @@ static inline void* vector_data(struct vector* const vec) {
 #define VECTOR_AT(VEC, T, IDX)                  \
   (((T*)vector_data((VEC)))[IDX])
 
-/* Some common typedefs */
+/** Arena **/
+
+/* A bump allocator for objects that die together. Allocations can't be freed
+ * individually; instead you take a mark and later release everything that was
+ * allocated since. Chunks freed by a release are kept around for reuse so a
+ * steady alloc/release cycle doesn't touch malloc at all. */
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT 16
+
+struct arena_chunk {
+  struct arena_chunk* prev; // the chunk allocated before this one, if any
+  char* end;
+  char data[];
+};
+
+struct arena {
+  struct arena_chunk* chunk; // current chunk
+  struct arena_chunk* spare; // chunks released for reuse
+  char* ptr, * end; // bump pointer into the current chunk
+};
+
+struct arena_mark {
+  struct arena_chunk* chunk;
+  char* ptr;
+};
+
+static void* arena_alloc_chunk(struct arena* const a, const size_t size) {
+  /* Slow path of arena_alloc: start a new chunk big enough for size */
+
+  struct arena_chunk* chunk = a->spare;
+
+  if (chunk && (size_t)(chunk->end - chunk->data) >= size) {
+    a->spare = chunk->prev;
+  } else {
+    const size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+
+    chunk = malloc(sizeof(*chunk) + chunk_size);
+
+    if (!chunk) {
+      error("Failed to allocate %lu bytes for arena", (unsigned long)chunk_size);
+    }
+
+    chunk->end = chunk->data + chunk_size;
+    memstat_note(memstat_arena, sizeof(*chunk) + chunk_size);
+  }
+
+  chunk->prev = a->chunk;
+  a->chunk = chunk;
+  a->ptr = chunk->data + size;
+  a->end = chunk->end;
+
+  return chunk->data;
+}
+
+static inline void* arena_alloc(struct arena* const a, size_t size) {
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+  if ((size_t)(a->end - a->ptr) < size) {
+    return arena_alloc_chunk(a, size);
+  }
+
+  void* const mem = a->ptr;
+  a->ptr += size;
+  return mem;
+}
+
+static inline struct arena_mark arena_mark(const struct arena* const a) {
+  const struct arena_mark mark = { a->chunk, a->ptr };
+  return mark;
+}
+
+static void arena_release(struct arena* const a, const struct arena_mark mark) {
+  /* Frees everything allocated from a since mark was taken */
+
+  while (a->chunk != mark.chunk) {
+    struct arena_chunk* const chunk = a->chunk;
+
+    a->chunk = chunk->prev;
+    chunk->prev = a->spare;
+    a->spare = chunk;
+  }
+
+  a->ptr = mark.ptr;
+  a->end = a->chunk ? a->chunk->end : NULL;
+}
+
+static void arena_free(struct arena* const a) {
+  /* Frees everything allocated from a, and its spare chunks too */
+
+  const struct arena_mark empty = { NULL, NULL };
+  arena_release(a, empty);
 
-typedef long (*guest_function)(void**);
+  while (a->spare) {
+    struct arena_chunk* const chunk = a->spare;
+
+    a->spare = chunk->prev;
+    memstat_forget(memstat_arena, sizeof(*chunk) + (chunk->end - chunk->data));
+    free(chunk);
+  }
+}
+
+static char* arena_strndup(struct arena* const a, const char* const str, const size_t len) {
+  char* const copy = arena_alloc(a, len + 1);
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  return copy;
+}
 
 /* Symbol table */
 
@@ -247,6 +437,7 @@ enum symbol_type {
   symtype_function,
   symtype_macro,
   symtype_value,
+  symtype_inline, // value is a struct inline_primitive
 };
 
 typedef unsigned long symbol_type_t;
@@ -256,33 +447,73 @@ struct symtab {
   char* symbol_name; // owning pointer
   void* symbol_value; // non-owning
   symbol_type_t symbol_type;
+  struct call_site* call_sites; // compiled calls to symbol_value
+  struct symtab* redefinition; // the function that took over call_sites
+  int immediate; // can touch the reader or compiler, see batch mode
+  struct context* owner; // the context that defined it
 };
 
-#define SYMTAB_EMPTY NULL
-
-static int symtab_name_equals(const struct symtab* const tab, const char* const symbol_name) {
-  return strcmp(tab->symbol_name, symbol_name) == 0;
-}
-
-static struct symtab* symtab_lookup_symbol(struct symtab* tab, const char* const symbol_name) {
-  return slist_find(&tab->list, (slist_find_pred)symtab_name_equals, symbol_name);
-}
+/* A call that compile emitted, kept so that it can be repointed when the
+ * function it calls is redefined */
+struct call_site {
+  struct slist list;
+  void* call;
+  const void* target; // where the call went when it was emitted or repointed
+};
 
-static struct symtab* symtab_add_symbol(struct symtab* const tab,
-                                        const char* const symbol_name,
-                                        void* const symbol_value,
-                                        const enum symbol_type symtype)
-{
-  struct symtab* const new_entry = calloc(sizeof(struct symtab), 1);
+#define SYMTAB_EMPTY NULL
 
-  new_entry->symbol_name = strdup(symbol_name);
-  new_entry->symbol_value = symbol_value;
-  new_entry->symbol_type = symtype;
+/* A function whose machine code is short enough that compile splices it into
+ * the caller instead of calling it. The function is still there for eval and
+ * anyone else who wants to call it. emit writes code that works on the stack
+ * in memory, emit_cached does the same thing to the register cache. */
+struct inline_primitive {
+  guest_function function;
+  void* (*emit)(void* pgm);
+  void (*emit_cached)(void);
+};
 
-  slist_push(&tab->list, &new_entry->list);
+/* Interpreter contexts */
+
+/* Everything a script can see or change lives in a context, so that several
+ * scripts can run at once in one process, one per thread. ctx is the running
+ * thread's context. A context made by context_new starts out with its base's
+ * definitions, and since symbol table entries belonging to some other context
+ * are only ever read, any number of contexts can share a base without locks
+ * as long as the base stays put once they've been made. */
+
+struct context {
+  struct symtab* symbol_table; // *SYMTAB*
+  struct readtable* readtable; // *READTAB*
+  struct input_source* input; // *IN*
+  struct output* output; // *OUT*
+  unsigned char* program; // *PROGRAM*
+
+  /* This context's share of the code heap, see code_reserve */
+  unsigned char* code_chunk; // start of the chunk *PROGRAM* is in
+  unsigned char* code_limit; // where that chunk's jump to the next one goes
+  struct vector code_chunks; // of struct code_chunk, oldest first
+  int code_writable; // only meaningful in W^X mode
+  struct vector code_absolutes; // see code_note_absolute
+  struct vector code_veneers; // of struct code_veneer, see code_reach
+
+  struct atom_table* atoms;
+  struct rd_symbol* atom_done;
+
+  /* Everything the reader returns lives in reader_arena until the form it was
+   * read for has been evaluated or compiled, whichever comes first; anything
+   * that has to outlive that (like string literals that compiled code points
+   * at) gets copied into permanent_arena, which is never released. */
+  struct arena reader_arena;
+  struct arena permanent_arena;
+  struct vector token; // the reader's scratch space, see input_scan
+  struct reader_classes* classes; // see reader_class
+
+  void** stack_base, ** stack_top; // the empty data stack, from stack_new
+  struct lazy_defun* lazy_definitions; // newest first
+};
 
-  return new_entry;
-}
+static __thread struct context* ctx;
 
 /* Reader structures */
 
@@ -303,6 +534,19 @@ struct rd_symbol {
   struct rd_object base;
 
   const char* repr;
+
+  /* Symbols are interned, so these are shared by every occurrence of the
+   * name. binding is the newest symbol table entry defined under repr, or
+   * NULL if there isn't one. */
+  size_t hash;
+  struct symtab* binding;
+
+  /* What eval does with the name, worked out the first time it's evaluated
+   * and good for as long as eval_epoch matches the atom table's epoch: call
+   * eval_function if there is one, otherwise push eval_value */
+  uint64_t eval_epoch;
+  guest_function eval_function;
+  void* eval_value;
 };
 
 struct rd_number {
@@ -317,11 +561,13 @@ struct rd_string {
   char* contents;
 };
 
+/* A quotation, [ ... ], is a list of the forms in it, one cell per form. The
+ * empty quotation is a single cell whose value is NULL. */
 struct rd_quote {
   struct rd_object base;
 
-  struct rd_quote* next;
-  void* value;
+  struct rd_quote* next; // the rest of the quotation
+  void* value; // the first form
 };
 
 struct rd_cons {
@@ -339,6 +585,181 @@ union rd_any {
   struct rd_cons cons;
 };
 
+/** Atoms **/
+
+/* The reader interns every symbol it reads in an open-addressed hash table of
+ * atoms, so each distinct name is represented by exactly one rd_symbol. The
+ * table doubles as the index of the symbol table: each atom's binding caches
+ * the newest definition of its name, which is what gives us shadowing on
+ * redefinition, and looking a symbol up is just loading its binding. The
+ * shadowed entries are still on the symbol table list for anyone who walks
+ * it. Guest code is free to repoint *SYMTAB*, so the table remembers which list
+ * head the bindings describe and rebinds everything when that changes.
+ *
+ * The epoch counts changes to the definitions, which is anything that could
+ * change what a name means: adding a symbol, rebinding, filling in a lazy
+ * definition, or guest code writing to memory, since that memory might be a
+ * symbol table entry. Each atom memoizes eval's dispatch under the epoch it
+ * was worked out in, so bumping the epoch invalidates all of them at once. */
+
+struct atom_table {
+  struct symtab* head; // the list head the bindings describe
+  struct rd_symbol** slots; // NULL for an empty slot
+  size_t fill, size; // size is zero or a power of two
+  uint64_t epoch; // starts at 1, so that a new atom's memo is stale
+};
+
+static size_t string_hash(const char* const str, const size_t len) {
+  /* FNV-1a */
+  size_t hash = 0xcbf29ce484222325ULL;
+
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (unsigned char)str[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+static struct rd_symbol** atom_probe(const struct atom_table* const table,
+                                     const char* const name,
+                                     const size_t len,
+                                     const size_t hash)
+{
+  /* Returns the slot holding the atom for name, or the empty slot where it
+   * would go. The table must have at least one free slot. */
+
+  const size_t mask = table->size - 1;
+
+  for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+    struct rd_symbol** const slot = &table->slots[i];
+
+    if (!*slot) {
+      return slot;
+    }
+
+    if ((*slot)->hash == hash && strncmp((*slot)->repr, name, len) == 0 && (*slot)->repr[len] == '\0') {
+      return slot;
+    }
+  }
+}
+
+static void atom_table_grow(struct atom_table* const table) {
+  const size_t old_size = table->size;
+  struct rd_symbol** const old_slots = table->slots;
+
+  table->size = old_size ? old_size * 2 : 256;
+  table->slots = calloc(sizeof(*table->slots), table->size);
+
+  if (!table->slots) {
+    error("Failed to allocate atom table of %lu slots", (unsigned long)table->size);
+  }
+
+  memstat_note(memstat_atom, table->size * sizeof(*table->slots));
+  memstat_forget(memstat_atom, old_size * sizeof(*table->slots));
+
+  for (size_t i = 0; i < old_size; ++i) {
+    struct rd_symbol* const atom = old_slots[i];
+
+    if (atom) {
+      *atom_probe(table, atom->repr, strlen(atom->repr), atom->hash) = atom;
+    }
+  }
+
+  free(old_slots);
+}
+
+static struct rd_symbol* intern(const char* const name, const size_t len) {
+  /* Returns the atom for the first len characters of name, creating it if
+   * this is the first time we've seen it. */
+
+  // keep the load factor at or below 1/2
+  if ((ctx->atoms->fill + 1) * 2 > ctx->atoms->size) {
+    atom_table_grow(ctx->atoms);
+  }
+
+  const size_t hash = string_hash(name, len);
+  struct rd_symbol** const slot = atom_probe(ctx->atoms, name, len, hash);
+
+  if (*slot) {
+    return *slot;
+  }
+
+  struct rd_symbol* const atom = calloc(sizeof(*atom), 1);
+
+  atom->base.type = rd_type_symbol;
+  atom->repr = strndup(name, len);
+  memstat_note(memstat_atom, sizeof(*atom) + len + 1);
+  atom->hash = hash;
+
+  *slot = atom;
+  ++ctx->atoms->fill;
+
+  return atom;
+}
+
+static inline void definitions_changed(void) {
+  ++ctx->atoms->epoch;
+}
+
+static void atoms_rebind(struct symtab* const head) {
+  definitions_changed();
+
+  for (size_t i = 0; i < ctx->atoms->size; ++i) {
+    if (ctx->atoms->slots[i]) {
+      ctx->atoms->slots[i]->binding = NULL;
+    }
+  }
+
+  ctx->atoms->head = head;
+
+  // the list runs newest to oldest, so the first entry seen for a name wins
+  for (struct symtab* tab = head; tab; tab = tab->list.next) {
+    struct rd_symbol* const atom = intern(tab->symbol_name, strlen(tab->symbol_name));
+
+    if (!atom->binding) {
+      atom->binding = tab;
+    }
+  }
+}
+
+static struct symtab* atom_binding(struct rd_symbol* const atom, struct symtab* const tab) {
+  /* Looks atom up in the symbol table tab. */
+
+  if (ctx->atoms->head != tab) {
+    atoms_rebind(tab);
+  }
+
+  return atom->binding;
+}
+
+static struct symtab* symtab_add_symbol(struct symtab* const tab,
+                                        const char* const symbol_name,
+                                        void* const symbol_value,
+                                        const enum symbol_type symtype)
+{
+  struct symtab* const new_entry = calloc(sizeof(struct symtab), 1);
+
+  new_entry->symbol_name = strdup(symbol_name);
+  memstat_note(memstat_symbol, sizeof(*new_entry) + strlen(symbol_name) + 1);
+  new_entry->symbol_value = symbol_value;
+  new_entry->symbol_type = symtype;
+  new_entry->owner = ctx;
+
+  slist_push(&tab->list, &new_entry->list);
+
+  definitions_changed();
+
+  // if the atoms describe tab they can be kept up to date cheaply, otherwise
+  // they'll get rebound on the next lookup anyway
+  if (ctx->atoms->head == tab) {
+    intern(symbol_name, strlen(symbol_name))->binding = new_entry;
+    ctx->atoms->head = new_entry;
+  }
+
+  return new_entry;
+}
+
 /** Readtable **/
 
 #define BIT(X) (1 << X)
@@ -360,654 +781,5505 @@ struct readtable {
   guest_function macro_dispatch[256];
 };
 
-/* Some globals */
+/* Output sinks */
 
-static struct symtab** global_symbol_table;
+/* What *OUT* points at. Printing goes into a buffer that's only written out
+ * when it fills up, on FLUSH, before blocking on input that isn't a regular
+ * file (so that prompts show up) and at exit. Anything too big for what's left
+ * of the buffer goes out along with it in a single writev. A sink without an
+ * fd keeps everything in memory instead, which is how -j collects what each
+ * file prints. */
 
-#define ADD_SYM(NAME, VALUE, SYMTYPE) \
-  *global_symbol_table = symtab_add_symbol(*global_symbol_table, (NAME), (void*)(VALUE), (SYMTYPE));
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#define OUTPUT_LONG_SIZE 20 // the most characters format_long writes
 
-static struct readtable** current_readtable;
+struct output {
+  struct slist list; // of sinks with an fd, see outputs
+  int fd; // -1 to keep everything in kept
+  struct vector kept;
+  size_t fill;
+  char buffer[OUTPUT_BUFFER_SIZE];
+};
 
-static unsigned char** program_area_ptr;
+static struct {
+  struct output* head; // flushed at exit
+  pthread_mutex_t lock;
+} outputs = { .lock = PTHREAD_MUTEX_INITIALIZER };
 
-static FILE** input;
-static FILE** output;
+static struct output* output_new(const int fd) {
+  struct output* const out = malloc(sizeof(*out));
 
-/* Functions */
+  if (!out) {
+    error("Failed to allocate an output buffer");
+  }
 
-#define GUESTFUNC(NAME, ARGNAME)                \
-  long NAME(void** ARGNAME)
+  out->fd = fd;
+  out->fill = 0;
+  vector_new(&out->kept);
 
-/** Reader functions **/
+  if (fd >= 0) {
+    pthread_mutex_lock(&outputs.lock);
+    slist_push(&outputs.head->list, &out->list);
+    outputs.head = out;
+    pthread_mutex_unlock(&outputs.lock);
+  }
 
-static GUESTFUNC(read_char, stack) {
-  FILE** const stream = stack_pop(&stack);
+  return out;
+}
 
-  stack_push(&stack, (void*)(intptr_t)fgetc(*stream));
+/* Waiting for an fd that isn't ready yet, which only happens to the
+ * non-blocking sockets of --serve. A connection gives its thread up to the
+ * others in the meantime (see connection_wait); anything else just blocks. */
 
-  return return_to_guest(stack);
-}
+static __thread void (*fd_waiter)(int fd, short events);
 
-static GUESTFUNC(unread_char, stack) {
-  intptr_t character = (intptr_t)stack_pop(&stack);
-  FILE** const stream = stack_pop(&stack);
+static void fd_wait(const int fd, const short events) {
+  if (fd_waiter) {
+    fd_waiter(fd, events);
+    return;
+  }
 
-  ungetc(character, *stream);
+  struct pollfd pfd = { .fd = fd, .events = events };
 
-  return return_to_guest(stack);
+  while (poll(&pfd, 1, -1) < 0 && errno == EINTR) {
+  }
 }
 
-static GUESTFUNC(read_symbol, stack) {
-  intptr_t character = (intptr_t)stack_pop(&stack);
-  FILE* const stream = stack_pop(&stack);
+static void output_send(struct output* const out, const char* const data, const size_t size) {
+  /* Writes out the buffer followed by data */
 
-  struct vector symrepr;
-  vector_new(&symrepr);
+  struct iovec iov[2] = {
+    { out->buffer, out->fill },
+    { (void*)data, size },
+  };
 
-  VECTOR_APPEND(&symrepr, char, character);
+  // empty first, so that an error writing doesn't try to write it all again
+  out->fill = 0;
 
-  while (1) {
-    character = fgetc(stream);
+  int i = 0;
 
-    if (character == EOF) {
-      break;
+  while (i < 2) {
+    if (iov[i].iov_len == 0) {
+      ++i;
+      continue;
     }
 
-    character = toupper(character & 0xff);
+    const ssize_t written = writev(out->fd, iov + i, 2 - i);
 
-    const char_prop_t cprop = (*current_readtable)->char_properties[character];
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
 
-    if (!(cprop & cprop_constituent)) {
-      ungetc(character, stream);
-      break;
-    }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        fd_wait(out->fd, POLLOUT);
+        continue;
+      }
 
-    VECTOR_APPEND(&symrepr, char, character);
-  }
+      error("Failed to write output: %s", strerror(errno));
+    }
 
-  struct rd_symbol* const sym = calloc(sizeof(*sym), 1);
+    size_t left = written;
 
-  sym->base.type = rd_type_symbol;
-  sym->repr = vector_data(&symrepr);
+    while (i < 2 && left >= iov[i].iov_len) {
+      left -= iov[i].iov_len;
+      ++i;
+    }
 
-  stack_push(&stack, sym);
+    if (i < 2) {
+      iov[i].iov_base = (char*)iov[i].iov_base + left;
+      iov[i].iov_len -= left;
+    }
+  }
+}
 
-  return return_to_guest(stack);
+static void output_flush(struct output* const out) {
+  if (out->fd >= 0) {
+    output_send(out, NULL, 0);
+  } else {
+    memcpy(vector_append(&out->kept, out->fill), out->buffer, out->fill);
+    out->fill = 0;
+  }
 }
 
-static GUESTFUNC(read_number, stack) {
-  /* This doesn't always read a number. For example, the tokens "-" and "+" are
-   * symbols, not numbers, but seeing a "-" or "+" will kick off read_number. */
+static void output_write(struct output* const out, const char* const data, const size_t size) {
+  if (size <= OUTPUT_BUFFER_SIZE - out->fill) {
+    memcpy(out->buffer + out->fill, data, size);
+    out->fill += size;
+  } else if (out->fd >= 0) {
+    output_send(out, data, size);
+  } else {
+    output_flush(out);
+    memcpy(vector_append(&out->kept, size), data, size);
+  }
+}
 
-  intptr_t character = (intptr_t)stack_pop(&stack);
-  FILE* const stream = stack_pop(&stack);
+static inline void output_char(struct output* const out, const char c) {
+  if (out->fill == OUTPUT_BUFFER_SIZE) {
+    output_flush(out);
+  }
 
-  struct vector repr;
-  vector_new(&repr);
+  out->buffer[out->fill++] = c;
+}
 
-  int negate = 0;
+static size_t format_long(char* const buf, const long value) {
+  /* Writes value in decimal at buf and returns how many characters that took,
+   * two digits at a time */
+
+  static const char pairs[] = (
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899"
+  );
+
+  char digits[OUTPUT_LONG_SIZE];
+  char* p = digits + sizeof(digits);
+
+  unsigned long n = value < 0 ? -(unsigned long)value : (unsigned long)value;
+
+  while (n >= 100) {
+    p -= 2;
+    memcpy(p, pairs + n % 100 * 2, 2);
+    n /= 100;
+  }
 
-  if (character == '-') {
-    negate = 1;
-  } else if (character == '+') {
-    // nothing
+  if (n >= 10) {
+    p -= 2;
+    memcpy(p, pairs + n * 2, 2);
   } else {
-    VECTOR_APPEND(&repr, char, character);
+    *--p = '0' + n;
   }
 
-  while (1) {
-    character = fgetc(stream);
-
-    if (character == EOF) {
-      break;
-    }
+  if (value < 0) {
+    *--p = '-';
+  }
 
-    const char_prop_t cprop = (*current_readtable)->char_properties[character];
+  const size_t length = digits + sizeof(digits) - p;
+  memcpy(buf, p, length);
 
-    if (!(cprop & cprop_number)) {
-      ungetc(character, stream);
-      break;
-    }
+  return length;
+}
 
-    VECTOR_APPEND(&repr, char, character);
+static void output_long(struct output* const out, const long value) {
+  if (OUTPUT_BUFFER_SIZE - out->fill < OUTPUT_LONG_SIZE) {
+    output_flush(out);
   }
 
-  if (vector_length(&repr) == 0) {
-    struct rd_symbol* const sym = calloc(sizeof(*sym), 1);
-    char* const repr = calloc(2, 1);
-    *repr = negate ? '-' : '+';
-    sym->base.type = rd_type_symbol;
-    sym->repr = repr;
-
-    stack_push(&stack, sym);
+  out->fill += format_long(out->buffer + out->fill, value);
+}
 
-    return return_to_guest(stack);
-  }
+static void output_printf(struct output* const out, const char* const format, ...) {
+  char small[256];
 
-  long value = 0;
-  long factor = 1;
+  va_list ap;
+  va_start(ap, format);
+  const int length = vsnprintf(small, sizeof(small), format, ap);
+  va_end(ap);
 
-  for (size_t i = vector_length(&repr); i > 0; --i) {
-    value += (VECTOR_AT(&repr, char, i - 1) - '0') * factor;
-    factor *= 10;
+  if (length < 0) {
+    return;
   }
 
-  if (negate) {
-    value = -value;
+  if ((size_t)length < sizeof(small)) {
+    output_write(out, small, length);
+    return;
   }
 
-  struct rd_number* const num = calloc(sizeof(*num), 1);
-  num->base.type = rd_type_number;
-  num->value = value;
+  char* const big = malloc(length + 1);
 
-  stack_push(&stack, num);
+  if (!big) {
+    error("Failed to allocate %d bytes of output", length + 1);
+  }
 
-  return return_to_guest(stack);
+  va_start(ap, format);
+  vsnprintf(big, length + 1, format, ap);
+  va_end(ap);
+
+  output_write(out, big, length);
+  free(big);
 }
 
-static GUESTFUNC(read_string, stack) {
-  intptr_t character = (intptr_t)stack_pop(&stack);
-  FILE* const stream = stack_pop(&stack);
+static void output_close(struct output* const out) {
+  /* Flushes out and frees it, closing its fd unless it's one of the standard
+   * ones */
 
-  struct vector str;
-  vector_new(&str);
+  output_flush(out);
 
-  while (1) {
-    character = fgetc(stream);
+  if (out->fd >= 0) {
+    pthread_mutex_lock(&outputs.lock);
 
-    if (character == EOF) {
-      error("EOF while reading string");
+    for (struct output** link = &outputs.head; *link; link = (struct output**)&(*link)->list.next) {
+      if (*link == out) {
+        *link = out->list.next;
+        break;
+      }
     }
 
-    if (character == '"') {
-      break;
-    }
+    pthread_mutex_unlock(&outputs.lock);
 
-    VECTOR_APPEND(&str, char, character);
+    if (out->fd > STDERR_FILENO) {
+      close(out->fd);
+    }
   }
 
-  struct rd_string* const rdstr = calloc(sizeof(*rdstr), 1);
-  rdstr->base.type = rd_type_string;
-  rdstr->contents = vector_data(&str);
+  vector_delete(&out->kept);
+  free(out);
+}
 
-  stack_push(&stack, rdstr);
+static void outputs_flush(void) {
+  /* Flushes every sink with an fd; runs at exit */
 
-  return return_to_guest(stack);
-}
+  pthread_mutex_lock(&outputs.lock);
 
-static GUESTFUNC(read_error, stack) {
-  error("%s not implemented", __func__);
-  return return_to_guest(stack);
-}
-static GUESTFUNC(read_quote, stack) {
-  error("%s not implemented", __func__);
-  return return_to_guest(stack);
-}
-static GUESTFUNC(read_list, stack) {
-  error("%s not implemented", __func__);
-  return return_to_guest(stack);
+  for (struct output* out = outputs.head; out; out = out->list.next) {
+    output_flush(out);
+  }
+
+  pthread_mutex_unlock(&outputs.lock);
 }
 
-static GUESTFUNC(read, stack) {
-  FILE* const stream = *(FILE**)stack_pop(&stack);
+static void output_delete(struct output* const out) {
+  /* Frees out without flushing it */
 
-  int character = 0;
+  if (out->fd >= 0) {
+    pthread_mutex_lock(&outputs.lock);
 
-  // the work done below is to fill this out so we know which function
-  // is appropriate to read the datum, then we call it and return
-  guest_function handler = NULL;
+    if (outputs.head == out) {
+      outputs.head = out->list.next;
+    } else {
+      for (struct output* o = outputs.head; o; o = o->list.next) {
+        if (o->list.next == out) {
+          o->list.next = out->list.next;
+          break;
+        }
+      }
+    }
 
-  while (1) {
-    character = fgetc(stream);
+    pthread_mutex_unlock(&outputs.lock);
+  }
 
-    if (character == EOF) {
-      stack_push(&stack, NULL);
-      return return_to_guest(stack);
+  vector_delete(&out->kept);
+  free(out);
+}
+
+static void output_flush_current(void) {
+  if (ctx && ctx->output) {
+    output_flush(ctx->output);
+  }
+}
+
+/* Input sources */
+
+/* What *IN* points at. The reader works directly out of data[pos..len): a
+ * regular file is mmapped whole so that's the entire file, anything else
+ * (pipes, terminals) is read through a big buffer that gets refilled as it
+ * runs dry. Refills keep the last character of the previous window at the
+ * front of the buffer so that it can always be pushed back. */
+
+#define INPUT_BUFFER_SIZE (256 * 1024)
+
+struct input_source {
+  const unsigned char* data;
+  size_t pos, len;
+
+  int fd;
+  int mapped; // data is the whole file, so there's nothing to refill
+  int eof; // a read on fd has returned end of file
+
+  unsigned char* buffer; // INPUT_BUFFER_SIZE + 1 bytes, NULL if mapped
+
+  /* When a character is pushed back that isn't the one at data[pos - 1] (only
+   * guest reader macros do that) the current window is stashed here and data
+   * is pointed at pushback instead. */
+  const unsigned char* saved_data;
+  size_t saved_pos, saved_len;
+  unsigned char pushback[16];
+};
+
+static struct input_source* input_open_fd(const int fd) {
+  struct input_source* const src = calloc(sizeof(*src), 1);
+  src->fd = fd;
+
+  struct stat st;
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* const data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (data != MAP_FAILED) {
+      madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+      src->data = data;
+      src->len = st.st_size;
+      src->mapped = 1;
+
+      return src;
     }
+  }
 
-    character = toupper(character & 0xff);
+  src->buffer = malloc(INPUT_BUFFER_SIZE + 1);
 
-    const char_prop_t cprop = (*current_readtable)->char_properties[character];
+  if (!src->buffer) {
+    error("Failed to allocate input buffer");
+  }
 
-    if (cprop & cprop_error) {
-      error("Reader encountered illegal character '%c' (%d)\n", character, character);
+  src->data = src->buffer;
+
+  return src;
+}
+
+static struct input_source* input_open(const char* const path) {
+  /* Returns NULL if path can't be opened. "-" is stdin. */
+
+  if (strcmp(path, "-") == 0) {
+    return input_open_fd(STDIN_FILENO);
+  }
+
+  const int fd = open(path, O_RDONLY);
+
+  if (fd < 0) {
+    return NULL;
+  }
+
+  return input_open_fd(fd);
+}
+
+static void input_close(struct input_source* const src) {
+  if (src->mapped) {
+    munmap((void*)src->data, src->len);
+  }
+
+  if (src->fd != STDIN_FILENO) {
+    close(src->fd);
+  }
+
+  free(src->buffer);
+  free(src);
+}
+
+static int input_refill(struct input_source* const src) {
+  /* Makes more data available at data[pos]. Returns zero at end of input. */
+
+  if (src->saved_data) {
+    src->data = src->saved_data;
+    src->pos = src->saved_pos;
+    src->len = src->saved_len;
+    src->saved_data = NULL;
+
+    if (src->pos < src->len) {
+      return 1;
     }
+  }
 
-    if (cprop & cprop_whitespace) {
+  if (src->mapped || src->eof) {
+    return 0;
+  }
+
+  // whoever's on the other end may be waiting to see what we've printed
+  output_flush_current();
+
+  size_t keep = 0;
+
+  if (src->len > 0) {
+    src->buffer[0] = src->data[src->len - 1];
+    keep = 1;
+  }
+
+  ssize_t got;
+
+  while ((got = read(src->fd, src->buffer + keep, INPUT_BUFFER_SIZE)) < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      fd_wait(src->fd, POLLIN);
+    } else if (errno != EINTR) {
+      break;
+    }
+  }
+
+  if (got < 0) {
+    error("Error reading input: %s", strerror(errno));
+  }
+
+  src->data = src->buffer;
+  src->pos = keep;
+  src->len = keep + got;
+
+  if (got == 0) {
+    src->eof = 1;
+    return 0;
+  }
+
+  return 1;
+}
+
+static inline int input_getc(struct input_source* const src) {
+  if (src->pos < src->len || input_refill(src)) {
+    return src->data[src->pos++];
+  }
+
+  return EOF;
+}
+
+static void input_ungetc(struct input_source* const src, const int character) {
+  if (character == EOF) {
+    return;
+  }
+
+  if (src->pos > 0 && src->data[src->pos - 1] == (unsigned char)character) {
+    --src->pos;
+    return;
+  }
+
+  if (!src->saved_data) {
+    src->saved_data = src->data;
+    src->saved_pos = src->pos;
+    src->saved_len = src->len;
+
+    src->data = src->pushback;
+    src->pos = src->len = sizeof(src->pushback);
+  }
+
+  if (src->pos == 0) {
+    error("Too many characters pushed back onto input");
+  }
+
+  src->pushback[--src->pos] = character;
+}
+
+/* Some globals */
+
+#define ADD_SYM(NAME, VALUE, SYMTYPE) \
+  add_symbol((NAME), (void*)(VALUE), (SYMTYPE));
+
+#define ADD_IMMEDIATE(NAME, FUNCTION) \
+  add_symbol((NAME), (void*)(FUNCTION), symtype_function)->immediate = 1;
+
+/* Code heap */
+
+/* Compiled code goes into one big reservation of address space, placed within
+ * rel32 reach of the kernel's own text so that calls from guest code to
+ * intrinsics (and to other guest code) can always use the short form. Pages
+ * are committed a chunk at a time as *PROGRAM* advances, and everything past
+ * the committed part is PROT_NONE, so stray writes off the end fault instead
+ * of scribbling on the heap. The emitters call code_reserve before writing
+ * anything, which commits more if needed and dies cleanly when the
+ * reservation is used up.
+ *
+ * The reservation is shared by every context, and each one takes chunks of it
+ * as it needs them. A chunk that follows straight on from the context's last
+ * one just extends it; otherwise the code carries on in the new chunk through
+ * a jump, which there's always room for at the end of a chunk. With only one
+ * context the code is all one contiguous run from the start of the heap.
+ *
+ * The reservation is committed a slab of CODE_HEAP_CHUNK_SIZE at a time, and
+ * contexts' chunks are carved out of slabs a page or more at a time, starting
+ * small and doubling as a context's code grows, so a context that compiles a
+ * few words only takes a page or two. What isn't handed out, from the ends of
+ * slabs and from contexts that were reset, is kept as spare chunks, which are
+ * handed out again before another slab is committed.
+ *
+ * In W^X mode the committed pages are never writable and executable at the
+ * same time: code_reserve makes the context's chunks writable, and they're
+ * flipped back to executable before running anything that might be guest
+ * code. Macros that write straight to *PROGRAM* don't work in that mode. */
+
+#define CODE_HEAP_DEFAULT_SIZE (256ULL * 1024 * 1024)
+#define CODE_HEAP_CHUNK_SIZE (2ULL * 1024 * 1024)
+#define CODE_HEAP_SLACK 256 // the most any one lowering step emits
+#define CODE_ALIGNMENT 16 // for function entries
+#define CODE_CHUNK_JUMP 16 // kept free at the end of a chunk for the jump out
+
+struct code_heap {
+  unsigned char* base;
+  unsigned char* committed; // end of the slabs handed out so far
+  unsigned char* limit; // end of the reservation
+
+  struct vector spare; // of struct code_chunk, reserved but in no context
+  pthread_mutex_t lock; // for spare
+
+  size_t size; // of the reservation
+  int wx;
+  int huge_pages;
+};
+
+struct code_chunk {
+  unsigned char* start, * end;
+};
+
+struct code_veneer {
+  const void* target;
+  unsigned char* veneer;
+};
+
+static struct code_heap code_heap = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .size = CODE_HEAP_DEFAULT_SIZE,
+};
+
+extern char __executable_start[], etext[], _end[];
+
+static int within_rel32(const uintptr_t a, const uintptr_t b) {
+  return (a > b ? a - b : b - a) < 0x7fff0000ULL;
+}
+
+static void* code_heap_map(const size_t size) {
+  /* Reserves size bytes as close to the kernel's text as we can get them */
+
+  const uintptr_t text = (uintptr_t)__executable_start;
+  const uintptr_t text_end = (uintptr_t)etext;
+  const uintptr_t align = CODE_HEAP_CHUNK_SIZE;
+  const int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+
+  for (int i = 1; i <= 16; ++i) {
+    const uintptr_t step = i * align * 16;
+
+    // alternate between just below the text and just above it
+    const uintptr_t hint = ((i & 1)
+                            ? ((text - size - step) & ~(align - 1))
+                            : ((text_end + step + align - 1) & ~(align - 1)));
+
+    if (!within_rel32(hint, text_end) || !within_rel32(hint + size, text)) {
       continue;
     }
 
-    if (cprop & cprop_macro) {
-      handler = (*current_readtable)->macro_dispatch[character];
+    void* const mem = mmap((void*)hint, size, PROT_NONE, flags | MAP_FIXED_NOREPLACE, -1, 0);
 
-      if (!handler) {
-        error("Macro character '%c' (%d) has no handler", character, character);
-      }
+    if (mem == MAP_FAILED) {
+      continue;
+    }
+
+    // older kernels treat MAP_FIXED_NOREPLACE as a hint
+    if (within_rel32((uintptr_t)mem, text_end) && within_rel32((uintptr_t)mem + size, text)) {
+      return mem;
+    }
+
+    munmap(mem, size);
+  }
+
+  // asm_call copes with far targets, it just costs more
+  void* const mem = mmap(NULL, size, PROT_NONE, flags, -1, 0);
+
+  if (mem == MAP_FAILED) {
+    error("Failed to reserve %lu bytes for the code heap: %s", (unsigned long)size, strerror(errno));
+  }
+
+  return mem;
+}
+
+static int code_heap_prot(const int writable) {
+  if (!code_heap.wx) {
+    return PROT_READ | PROT_WRITE | PROT_EXEC;
+  }
+
+  return writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC;
+}
+
+static void code_heap_init(void) {
+  code_heap.base = code_heap_map(code_heap.size);
+  code_heap.committed = code_heap.base;
+  code_heap.limit = code_heap.base + code_heap.size;
+
+  if (code_heap.huge_pages && madvise(code_heap.base, code_heap.size, MADV_HUGEPAGE) != 0) {
+    fprintf(stderr, "Warning: huge pages unavailable for the code heap: %s\n", strerror(errno));
+  }
+}
 
+static void code_heap_protect(const int writable) {
+  /* Only touches ctx's own chunks, since other contexts may be running code
+   * in theirs */
+
+  if (!code_heap.wx || ctx->code_writable == writable) {
+    return;
+  }
+
+  for (size_t i = 0; i < vector_length(&ctx->code_chunks) / sizeof(struct code_chunk); ++i) {
+    const struct code_chunk* const chunk = &VECTOR_AT(&ctx->code_chunks, struct code_chunk, i);
+
+    if (mprotect(chunk->start, chunk->end - chunk->start, code_heap_prot(writable)) != 0) {
+      error("Failed to change code heap protection: %s", strerror(errno));
+    }
+  }
+
+  ctx->code_writable = writable;
+}
+
+static inline void code_heap_executable(void) {
+  code_heap_protect(0);
+}
+
+static void code_add_chunk(unsigned char* const start, const size_t size) {
+  /* Gives ctx the committed memory at start for its code */
+
+  const size_t count = vector_length(&ctx->code_chunks) / sizeof(struct code_chunk);
+  struct code_chunk* const last = count ? &VECTOR_AT(&ctx->code_chunks, struct code_chunk, count - 1) : NULL;
+
+  if (last && last->end == start) {
+    last->end += size;
+  } else {
+    if (last) {
+      ctx->program = asm_jmp(ctx->program, start);
+    }
+
+    const struct code_chunk chunk = { start, start + size };
+    VECTOR_APPEND(&ctx->code_chunks, struct code_chunk, chunk);
+
+    ctx->code_chunk = start;
+    ctx->program = start;
+  }
+
+  ctx->code_limit = start + size - CODE_CHUNK_JUMP;
+}
+
+static void code_spare_add(struct code_chunk chunk) {
+  /* Puts chunk on the spare list, in one piece with any spares on either side
+   * of it. The caller holds the lock. */
+
+  size_t count = vector_length(&code_heap.spare) / sizeof(struct code_chunk);
+
+  for (size_t i = 0; i < count; ) {
+    struct code_chunk* const spare = &VECTOR_AT(&code_heap.spare, struct code_chunk, i);
+
+    if (spare->end == chunk.start || spare->start == chunk.end) {
+      chunk.start = spare->start < chunk.start ? spare->start : chunk.start;
+      chunk.end = spare->end > chunk.end ? spare->end : chunk.end;
+
+      *spare = VECTOR_AT(&code_heap.spare, struct code_chunk, --count);
+      code_heap.spare.fill -= sizeof(struct code_chunk);
+      continue;
+    }
+
+    ++i;
+  }
+
+  VECTOR_APPEND(&code_heap.spare, struct code_chunk, chunk);
+}
+
+static void code_commit(void) {
+  /* Gives ctx another chunk, carved out of a spare one if it can be: the one
+   * that follows straight on from ctx's last chunk if there is one, or else
+   * any that's big enough. Otherwise it comes from a fresh slab. */
+
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t count = vector_length(&ctx->code_chunks) / sizeof(struct code_chunk);
+  const unsigned char* const end = count ? VECTOR_AT(&ctx->code_chunks, struct code_chunk, count - 1).end : NULL;
+
+  size_t held = 0;
+
+  for (size_t i = 0; i < count; ++i) {
+    const struct code_chunk* const chunk = &VECTOR_AT(&ctx->code_chunks, struct code_chunk, i);
+    held += chunk->end - chunk->start;
+  }
+
+  // as much again as ctx has already, within reason
+  held = (held + page - 1) & ~(page - 1);
+  const size_t want = held < page ? page : held > CODE_HEAP_CHUNK_SIZE ? CODE_HEAP_CHUNK_SIZE : held;
+
+  unsigned char* chunk = NULL;
+  size_t size = 0;
+
+  pthread_mutex_lock(&code_heap.lock);
+
+  const size_t spares = vector_length(&code_heap.spare) / sizeof(struct code_chunk);
+  size_t found = spares;
+
+  for (size_t i = 0; i < spares; ++i) {
+    const struct code_chunk* const spare = &VECTOR_AT(&code_heap.spare, struct code_chunk, i);
+
+    if (spare->start == end) {
+      found = i;
       break;
     }
 
-    if (cprop & cprop_number_init) {
-      handler = read_number;
+    if (found == spares && (size_t)(spare->end - spare->start) >= want) {
+      found = i;
+    }
+  }
+
+  if (found < spares) {
+    struct code_chunk* const spare = &VECTOR_AT(&code_heap.spare, struct code_chunk, found);
+    const size_t left = spare->end - spare->start;
+
+    chunk = spare->start;
+    size = left < want ? left : want;
+    spare->start += size;
+
+    if (spare->start == spare->end) {
+      *spare = VECTOR_AT(&code_heap.spare, struct code_chunk, spares - 1);
+      code_heap.spare.fill -= sizeof(struct code_chunk);
+    }
+  } else {
+    unsigned char* const slab = __atomic_fetch_add(&code_heap.committed, CODE_HEAP_CHUNK_SIZE, __ATOMIC_RELAXED);
+
+    if (slab < code_heap.limit) {
+      // an image can leave the slabs ending off a slab boundary
+      const size_t left = code_heap.limit - slab;
+      const size_t slab_size = left < CODE_HEAP_CHUNK_SIZE ? left : CODE_HEAP_CHUNK_SIZE;
+
+      chunk = slab;
+      size = slab_size < want ? slab_size : want;
+
+      if (size < slab_size) {
+        const struct code_chunk rest = { slab + size, slab + slab_size };
+        code_spare_add(rest);
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&code_heap.lock);
+
+  if (!chunk) {
+    error("Code heap exhausted after %lu bytes; try a bigger --code-heap",
+          (unsigned long)code_heap.size);
+  }
+
+  if (mprotect(chunk, size, code_heap_prot(ctx->code_writable)) != 0) {
+    error("Failed to commit code heap: %s", strerror(errno));
+  }
+
+  memset(chunk, 0xcc, size); // int3, in case anyone runs off the end
+
+  code_add_chunk(chunk, size);
+}
+
+static void code_release(void) {
+  /* Gives ctx's chunks back as spares, which leaves it with no code */
+
+  const size_t count = vector_length(&ctx->code_chunks) / sizeof(struct code_chunk);
+
+  for (size_t i = 0; i < count; ++i) {
+    const struct code_chunk* const chunk = &VECTOR_AT(&ctx->code_chunks, struct code_chunk, i);
+
+    // so that anything still pointing into the chunk faults
+    if (mprotect(chunk->start, chunk->end - chunk->start, PROT_NONE) != 0) {
+      error("Failed to release code heap: %s", strerror(errno));
+    }
+  }
+
+  pthread_mutex_lock(&code_heap.lock);
+
+  for (size_t i = 0; i < count; ++i) {
+    code_spare_add(VECTOR_AT(&ctx->code_chunks, struct code_chunk, i));
+  }
+
+  pthread_mutex_unlock(&code_heap.lock);
+
+  ctx->code_chunks.fill = 0;
+  ctx->code_chunk = NULL;
+  ctx->code_limit = NULL;
+  ctx->program = NULL;
+}
+
+static void code_reserve(const size_t size) {
+  /* Makes sure at least size bytes can be written at *PROGRAM* */
+
+  code_heap_protect(1);
+
+  if (ctx->program > ctx->code_limit || ctx->program < ctx->code_chunk) {
+    error("*PROGRAM* points outside the code heap");
+  }
+
+  while ((size_t)(ctx->code_limit - ctx->program) < size) {
+    code_commit();
+  }
+}
+
+static void code_align(void) {
+  /* Pads *PROGRAM* out to a good place to start a function */
+
+  code_reserve(CODE_ALIGNMENT);
+
+  while ((uintptr_t)ctx->program & (CODE_ALIGNMENT - 1)) {
+    *ctx->program++ = 0xcc;
+  }
+}
+
+/* ctx->code_absolutes holds the 64-bit immediates in compiled code that might
+ * be addresses, as offsets from the start of the code heap in the order they
+ * were emitted. Saving an image needs these to relocate them. */
+
+static void code_note_absolute(const unsigned char* const start,
+                               const unsigned char* const end,
+                               const uint64_t value)
+{
+  /* Notes where value was put in the code emitted between start and end, if it
+   * was put there as a 64-bit immediate */
+
+  if (value == (uint64_t)(int32_t)value) {
+    return;
+  }
+
+  for (const unsigned char* p = start; p + sizeof(value) <= end; ++p) {
+    if (memcmp(p, &value, sizeof(value)) == 0) {
+      VECTOR_APPEND(&ctx->code_absolutes, size_t, p - code_heap.base);
+      return;
+    }
+  }
+}
+
+static void code_forget_absolutes(const unsigned char* const from) {
+  /* Forgets the immediates noted at or after from, when the code there is
+   * thrown away */
+
+  while (vector_length(&ctx->code_absolutes) > 0) {
+    const size_t last = vector_length(&ctx->code_absolutes) / sizeof(size_t) - 1;
+
+    if (code_heap.base + VECTOR_AT(&ctx->code_absolutes, size_t, last) < from) {
       break;
     }
 
-    if (cprop & cprop_constituent) {
-      handler = read_symbol;
+    ctx->code_absolutes.fill -= sizeof(size_t);
+  }
+
+  while (vector_length(&ctx->code_veneers) > 0) {
+    const size_t last = vector_length(&ctx->code_veneers) / sizeof(struct code_veneer) - 1;
+
+    if (VECTOR_AT(&ctx->code_veneers, struct code_veneer, last).veneer < from) {
       break;
     }
 
-    if (cprop & cprop_number) {
-      error("Encountered number continuation outside of a number");
+    ctx->code_veneers.fill -= sizeof(struct code_veneer);
+  }
+}
+
+/* A call or jump from *PROGRAM* to something more than rel32 away goes through
+ * a veneer instead, an indirect jump to the target dropped into the code
+ * nearby. Veneers are shared by anything in reach, and kept in
+ * ctx->code_veneers in the order they were emitted. */
+
+static struct code_veneer* code_find_veneer(const void* const from, const void* const target) {
+  /* Returns a veneer to target that a rel32 branch at from can reach, or
+   * NULL if there isn't one */
+
+  for (size_t i = vector_length(&ctx->code_veneers) / sizeof(struct code_veneer); i-- > 0; ) {
+    struct code_veneer* const known = &VECTOR_AT(&ctx->code_veneers, struct code_veneer, i);
+
+    if (known->target == target && within_rel32((uintptr_t)from, (uintptr_t)known->veneer)) {
+      return known;
+    }
+  }
+
+  return NULL;
+}
+
+static const void* code_reach(const void* const target) {
+  /* Returns what a rel32 call or jump at *PROGRAM* should go to to end up at
+   * target, emitting a veneer if there isn't one in reach. Anything that's
+   * about to be emitted has to come after this. */
+
+  if (within_rel32((uintptr_t)ctx->program, (uintptr_t)target)) {
+    return target;
+  }
+
+  const struct code_veneer* const known = code_find_veneer(ctx->program, target);
+
+  if (known) {
+    return known->veneer;
+  }
+
+  code_reserve(CODE_HEAP_SLACK);
+
+  unsigned char* const over = asm_jump(ctx->program);
+  const struct code_veneer veneer = { target, over };
+
+  ctx->program = asm_veneer(over, target);
+  code_note_absolute(over, ctx->program, (uintptr_t)target);
+
+  if (!asm_patch_jump(over, ctx->program)) {
+    error("Branch out of range in the code heap");
+  }
+
+  VECTOR_APPEND(&ctx->code_veneers, struct code_veneer, veneer);
+
+  return veneer.veneer;
+}
+
+static const void* code_repoint(void* const call, const void* const target) {
+  /* Points a call or jump emitted by asm_call or asm_jmp at target, through a
+   * veneer if it has to. Returns where it goes now, or NULL if it can't be
+   * made to reach target. */
+
+  if (asm_patch_call(call, target)) {
+    return target;
+  }
+
+  const struct code_veneer* const known = code_find_veneer(call, target);
+
+  if (known && asm_patch_call(call, known->veneer)) {
+    return known->veneer;
+  }
+
+  if (within_rel32((uintptr_t)ctx->program, (uintptr_t)call)) {
+    const void* const veneer = code_reach(target);
+
+    if (asm_patch_call(call, veneer)) {
+      return veneer;
+    }
+  }
+
+  // a veneer that the call already goes through can be repointed instead;
+  // everything else using it was going to the same place
+  const void* const current = asm_call_target(call);
+
+  for (size_t i = 0; i < vector_length(&ctx->code_veneers) / sizeof(struct code_veneer); ++i) {
+    struct code_veneer* const veneer = &VECTOR_AT(&ctx->code_veneers, struct code_veneer, i);
+
+    if (veneer->veneer == current) {
+      asm_veneer(veneer->veneer, target);
+      veneer->target = target;
+      return current;
+    }
+  }
+
+  return NULL;
+}
+
+/* Call sites */
+
+static __thread int record_call_sites = 1; // off while compiling code that won't be kept
+
+/* Only calls to ctx's own functions are recorded. The rest belong to a shared
+ * base, and redefining one of those in ctx can't repoint anything: the base's
+ * code has to stay as it is for everyone else using it, so calls to it keep
+ * going to the old definition. */
+
+static void record_call_site(struct symtab* const callee, void* const call, const void* const target) {
+  if (!record_call_sites || callee->owner != ctx) {
+    return;
+  }
+
+  struct call_site* const site = malloc(sizeof(*site));
+  memstat_note(memstat_call_site, sizeof(*site));
+
+  site->call = call;
+  site->target = target;
+
+  slist_push(&callee->call_sites->list, &site->list);
+  callee->call_sites = site;
+}
+
+static void repoint_call_sites(struct symtab* const old, struct symtab* const new) {
+  /* Points everything that calls old at new instead, and hands the call sites
+   * over to new so that the next redefinition finds them too */
+
+  code_heap_protect(1);
+
+  struct call_site* site = old->call_sites;
+
+  while (site) {
+    struct call_site* const next = site->list.next;
+    const void* const target = asm_call_target(site->call);
+
+    // skip anything that's been overwritten since it was compiled
+    if (target == site->target || target == old->symbol_value) {
+      site->target = code_repoint(site->call, new->symbol_value);
+
+      if (!site->target) {
+        error("Can't repoint a call to '%s' at its new definition", new->symbol_name);
+      }
+
+      slist_push(&new->call_sites->list, &site->list);
+      new->call_sites = site;
+    } else {
+      memstat_forget(memstat_call_site, sizeof(*site));
+      free(site);
+    }
+
+    site = next;
+  }
+
+  old->call_sites = NULL;
+  old->redefinition = new;
+}
+
+static struct symtab* add_symbol(const char* const name, void* const value, const enum symbol_type symtype) {
+  /* Defines name in the global symbol table. Redefining a function fixes up
+   * the code that calls the old definition. */
+
+  struct symtab* const previous = atom_binding(intern(name, strlen(name)), ctx->symbol_table);
+
+  ctx->symbol_table = symtab_add_symbol(ctx->symbol_table, name, value, symtype);
+
+  if (previous && previous->owner == ctx
+      && previous->symbol_type == symtype_function && symtype == symtype_function)
+  {
+    repoint_call_sites(previous, ctx->symbol_table);
+  }
+
+  return ctx->symbol_table;
+}
+
+/* Functions */
+
+#define GUESTFUNC(NAME, ARGNAME)                \
+  void** NAME(void** ARGNAME)
+
+/** Reader functions **/
+
+static GUESTFUNC(read_char, stack) {
+  struct input_source** const stream = stack_pop(&stack);
+
+  stack_push(&stack, (void*)(intptr_t)input_getc(*stream));
+
+  return stack;
+}
+
+static GUESTFUNC(unread_char, stack) {
+  intptr_t character = (intptr_t)stack_pop(&stack);
+  struct input_source** const stream = stack_pop(&stack);
+
+  input_ungetc(*stream, character);
+
+  return stack;
+}
+
+static inline int readtable_char(const int character, const int fold) {
+  return fold ? toupper(character) : character;
+}
+
+/** Classifying input **/
+
+/* The reader spends most of its time finding where runs of whitespace and
+ * tokens end, so those runs are scanned for a whole class of characters at a
+ * time. A class is the set of bytes whose readtable entry has some properties
+ * (after upcasing, for the classes that fold case). Membership is a table
+ * lookup per byte, or 16 or 32 bytes at a time with pshufb: each byte's high
+ * nibble picks a bit out of hi and its low nibble a set of bits out of lo, and
+ * the byte is in the class if they have a bit in common. That can describe any
+ * class with no more than eight different patterns of low nibbles across the
+ * sixteen high nibbles, which is plenty for any sensible readtable; classes
+ * that need more are scanned a byte at a time.
+ *
+ * The classes are built from a copy of the readtable and rebuilt when read
+ * finds that *READTAB* has been repointed or edited. */
+
+#define READER_CLASSES 4
+
+struct byte_class {
+  char_prop_t props, exclude; // members have one of props and none of exclude
+  int fold;
+  int nibbles; // lo and hi describe the class
+  unsigned char lo[16], hi[16];
+  unsigned char member[256];
+};
+
+struct reader_classes {
+  const struct readtable* readtable; // what these were built from
+  char_prop_t char_properties[256]; // and what it said at the time
+  size_t count;
+  struct byte_class classes[READER_CLASSES];
+};
+
+static int simd_enabled = 1;
+
+static size_t (*class_span_vector)(const struct byte_class*, const unsigned char*, size_t);
+
+static void (*fill_vector)(uint64_t*, uint64_t, size_t); // see FILL
+static void fill_avx2(uint64_t* dst, uint64_t pattern, size_t count);
+
+static void byte_class_build(struct byte_class* const cls,
+                             const char_prop_t* const cprops,
+                             const char_prop_t props,
+                             const char_prop_t exclude,
+                             const int fold)
+{
+  cls->props = props;
+  cls->exclude = exclude;
+  cls->fold = fold;
+
+  uint16_t rows[16] = { 0 }; // which low nibbles are members, by high nibble
+
+  for (int c = 0; c < 256; ++c) {
+    const char_prop_t p = cprops[readtable_char(c, fold)];
+
+    cls->member[c] = (p & props) && !(p & exclude);
+
+    if (cls->member[c]) {
+      rows[c >> 4] |= 1 << (c & 15);
+    }
+  }
+
+  // give each distinct row a bit
+  uint16_t patterns[8];
+  int pattern_count = 0;
+
+  memset(cls->lo, 0, sizeof(cls->lo));
+  memset(cls->hi, 0, sizeof(cls->hi));
+  cls->nibbles = 1;
+
+  for (int h = 0; h < 16 && cls->nibbles; ++h) {
+    if (!rows[h]) {
+      continue;
+    }
+
+    int k = 0;
+
+    while (k < pattern_count && patterns[k] != rows[h]) {
+      ++k;
+    }
+
+    if (k == pattern_count) {
+      if (pattern_count == 8) {
+        cls->nibbles = 0;
+        break;
+      }
+
+      patterns[pattern_count++] = rows[h];
+
+      for (int l = 0; l < 16; ++l) {
+        if (rows[h] & (1 << l)) {
+          cls->lo[l] |= 1 << k;
+        }
+      }
+    }
+
+    cls->hi[h] = 1 << k;
+  }
+}
+
+static struct reader_classes* reader_classes_check(void) {
+  /* Returns ctx's classes, rebuilding them if the readtable isn't what they
+   * were built from */
+
+  struct reader_classes* rc = ctx->classes;
+
+  if (!rc) {
+    rc = ctx->classes = calloc(sizeof(*rc), 1);
+
+    if (!rc) {
+      error("Failed to allocate reader tables");
+    }
+  }
+
+  const char_prop_t* const cprops = ctx->readtable->char_properties;
+
+  if (rc->readtable != ctx->readtable || memcmp(rc->char_properties, cprops, sizeof(rc->char_properties)) != 0) {
+    rc->readtable = ctx->readtable;
+    memcpy(rc->char_properties, cprops, sizeof(rc->char_properties));
+    rc->count = 0;
+  }
+
+  return rc;
+}
+
+static const struct byte_class* reader_class(const char_prop_t props, const char_prop_t exclude, const int fold) {
+  /* Returns the class for props, exclude and fold. Only read checks whether
+   * the readtable has been edited, since nothing else between it and here
+   * can edit it. */
+
+  struct reader_classes* const rc = (ctx->classes && ctx->classes->readtable == ctx->readtable
+                                     ? ctx->classes
+                                     : reader_classes_check());
+
+  for (size_t i = 0; i < rc->count; ++i) {
+    const struct byte_class* const cls = &rc->classes[i];
+
+    if (cls->props == props && cls->exclude == exclude && cls->fold == fold) {
+      return cls;
+    }
+  }
+
+  // the classes in use never change, so evicting one never happens in practice
+  struct byte_class* const cls = &rc->classes[rc->count < READER_CLASSES ? rc->count++ : READER_CLASSES - 1];
+
+  byte_class_build(cls, rc->char_properties, props, exclude, fold);
+
+  return cls;
+}
+
+static size_t class_span_scalar(const struct byte_class* const cls, const unsigned char* const p, const size_t len) {
+  size_t i = 0;
+
+  while (i < len && cls->member[p[i]]) {
+    ++i;
+  }
+
+  return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t class_span_ssse3(const struct byte_class* const cls, const unsigned char* const p, const size_t len) {
+  const __m128i lo = _mm_loadu_si128((const __m128i*)cls->lo);
+  const __m128i hi = _mm_loadu_si128((const __m128i*)cls->hi);
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    const __m128i bytes = _mm_loadu_si128((const __m128i*)(p + i));
+    const __m128i low = _mm_shuffle_epi8(lo, _mm_and_si128(bytes, nibble));
+    const __m128i high = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+    const __m128i outside = _mm_cmpeq_epi8(_mm_and_si128(low, high), _mm_setzero_si128());
+    const unsigned mask = _mm_movemask_epi8(outside);
+
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+
+  return i + class_span_scalar(cls, p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t class_span_avx2(const struct byte_class* const cls, const unsigned char* const p, const size_t len) {
+  // vpshufb looks up within each 128-bit lane, so both lanes get the tables
+  const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)cls->lo));
+  const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)cls->hi));
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    const __m256i bytes = _mm256_loadu_si256((const __m256i*)(p + i));
+    const __m256i low = _mm256_shuffle_epi8(lo, _mm256_and_si256(bytes, nibble));
+    const __m256i high = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble));
+    const __m256i outside = _mm256_cmpeq_epi8(_mm256_and_si256(low, high), _mm256_setzero_si256());
+    const unsigned mask = _mm256_movemask_epi8(outside);
+
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+
+  return i + class_span_ssse3(cls, p + i, len - i);
+}
+
+static void simd_init(void) {
+  if (!simd_enabled) {
+    return;
+  }
+
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) {
+    class_span_vector = class_span_avx2;
+    fill_vector = fill_avx2;
+  } else if (__builtin_cpu_supports("ssse3")) {
+    class_span_vector = class_span_ssse3;
+  }
+}
+
+static inline size_t class_span(const struct byte_class* const cls, const unsigned char* const p, const size_t len) {
+  /* Returns how many of the len bytes at p are in cls before the first one
+   * that isn't */
+
+  if (len >= 16 && cls->nibbles && class_span_vector) {
+    return class_span_vector(cls, p, len);
+  }
+
+  return class_span_scalar(cls, p, len);
+}
+
+static const char* input_scan(struct input_source* const src,
+                              const int first,
+                              const char_prop_t props,
+                              const int fold,
+                              struct vector* const scratch,
+                              size_t* const len)
+{
+  /* Scans the rest of a token, i.e. every following character whose readtable
+   * entry has one of props (looked up after upcasing if fold is set). If first
+   * isn't EOF it's a character the caller has just read and the token starts
+   * with it. The token is normally returned as a pointer straight into the
+   * input buffer; it's only copied into scratch if it runs off the end of the
+   * buffer and we need to refill, or if first didn't come from the buffer. */
+
+  const struct byte_class* const cls = reader_class(props, 0, fold);
+
+  size_t start = src->pos;
+  size_t end = src->pos;
+
+  if (first != EOF) {
+    if (src->pos > 0 && readtable_char(src->data[src->pos - 1], fold) == first) {
+      --start;
+    } else {
+      goto slow;
+    }
+  }
+
+  end += class_span(cls, src->data + end, src->len - end);
+
+  // with the pushback window in place, the token can carry on in saved_data
+  if (end < src->len || ((src->mapped || src->eof) && !src->saved_data)) {
+    src->pos = end;
+    *len = end - start;
+    return (const char*)src->data + start;
+  }
+
+slow:
+  if (start == end && first != EOF) {
+    VECTOR_APPEND(scratch, char, first);
+  } else {
+    memcpy(vector_append(scratch, end - start), src->data + start, end - start);
+  }
+
+  src->pos = end;
+
+  while (1) {
+    const int character = input_getc(src);
+
+    if (character == EOF) {
+      break;
+    }
+
+    if (!cls->member[character]) {
+      input_ungetc(src, character);
+      break;
+    }
+
+    VECTOR_APPEND(scratch, char, character);
+  }
+
+  *len = vector_length(scratch);
+  return vector_data(scratch);
+}
+
+static GUESTFUNC(read_symbol, stack) {
+  const intptr_t character = (intptr_t)stack_pop(&stack);
+  struct input_source* const stream = stack_pop(&stack);
+
+  struct vector* const symrepr = &ctx->token;
+  symrepr->fill = 0;
+
+  size_t len;
+  const char* repr = input_scan(stream, character, cprop_constituent, 1, symrepr, &len);
+
+  for (size_t i = 0; i < len; ++i) {
+    if (repr[i] != toupper((unsigned char)repr[i])) {
+      // we can't write into the input buffer so upcase a copy
+      if (repr != vector_data(symrepr)) {
+        memcpy(vector_append(symrepr, len), repr, len);
+        repr = vector_data(symrepr);
+      }
+
+      for (; i < len; ++i) {
+        VECTOR_AT(symrepr, char, i) = toupper((unsigned char)repr[i]);
+      }
+    }
+  }
+
+  struct rd_symbol* const sym = intern(repr, len);
+
+  stack_push(&stack, sym);
+
+  return stack;
+}
+
+static const char* number_parse(const char* const digits,
+                                const size_t len,
+                                const unsigned radix,
+                                const unsigned long limit,
+                                unsigned long* const value)
+{
+  /* Parses digits in one pass. Returns NULL if that worked, otherwise what
+   * was wrong with them. */
+
+  if (len == 0) {
+    return "Invalid number";
+  }
+
+  unsigned long n = 0;
+
+  for (size_t i = 0; i < len; ++i) {
+    const int c = toupper((unsigned char)digits[i]);
+    const unsigned digit = isdigit(c) ? (unsigned)(c - '0') : isupper(c) ? (unsigned)(c - 'A' + 10) : radix;
+
+    if (digit >= radix) {
+      return "Invalid number";
+    }
+
+    if (n > (limit - digit) / radix) {
+      return "Number out of range";
+    }
+
+    n = n * radix + digit;
+  }
+
+  *value = n;
+
+  return NULL;
+}
+
+static GUESTFUNC(read_number, stack) {
+  /* This doesn't always read a number. For example, the tokens "-" and "+" are
+   * symbols, not numbers, but seeing a "-" or "+" will kick off read_number.
+   *
+   * Numbers are decimal unless they start with 0x, 0o or 0b. Decimal ones have
+   * to fit in a long; the others can be anything that fits in 64 bits, so that
+   * bit patterns can be written as they are. */
+
+  const intptr_t character = (intptr_t)stack_pop(&stack);
+  struct input_source* const stream = stack_pop(&stack);
+
+  struct vector* const scratch = &ctx->token;
+  scratch->fill = 0;
+
+  const int negate = character == '-';
+  const int first = (character == '-' || character == '+') ? EOF : (int)character;
+
+  size_t len;
+  const char* repr = input_scan(stream, first, cprop_number, 0, scratch, &len);
+
+  if (len == 0) {
+    stack_push(&stack, intern(negate ? "-" : "+", 1));
+
+    return stack;
+  }
+
+  unsigned radix = 10;
+  const char* prefix = "";
+
+  if (len == 1 && repr[0] == '0') {
+    const int next = input_getc(stream);
+
+    switch (toupper(next)) {
+    case 'X': radix = 16; prefix = "0x"; break;
+    case 'O': radix = 8; prefix = "0o"; break;
+    case 'B': radix = 2; prefix = "0b"; break;
+    default: input_ungetc(stream, next); break;
+    }
+
+    if (radix != 10) {
+      scratch->fill = 0;
+      repr = input_scan(stream, EOF, cprop_number | cprop_constituent, 0, scratch, &len);
+    }
+  }
+
+  const unsigned long most_negative = (unsigned long)LONG_MAX + 1;
+  const unsigned long limit = negate ? most_negative : radix != 10 ? ULONG_MAX : LONG_MAX;
+
+  unsigned long magnitude;
+  const char* const problem = number_parse(repr, len, radix, limit, &magnitude);
+
+  if (problem) {
+    error("%s: '%s%s%.*s'", problem, negate ? "-" : "", prefix, (int)len, repr);
+  }
+
+  struct rd_number* const num = arena_alloc(&ctx->reader_arena, sizeof(*num));
+  num->base.type = rd_type_number;
+  num->value = (long)(negate ? 0 - magnitude : magnitude);
+
+  stack_push(&stack, num);
+
+  return stack;
+}
+
+static GUESTFUNC(read_string, stack) {
+  stack_pop(&stack); // the opening quote
+  struct input_source* const stream = stack_pop(&stack);
+
+  struct rd_string* const rdstr = arena_alloc(&ctx->reader_arena, sizeof(*rdstr));
+  rdstr->base.type = rd_type_string;
+
+  /* Usually the whole string is sitting in the buffer already */
+
+  const unsigned char* const start = stream->data + stream->pos;
+  const unsigned char* const end = memchr(start, '"', stream->len - stream->pos);
+
+  if (end) {
+    rdstr->contents = arena_strndup(&ctx->reader_arena, (const char*)start, end - start);
+    stream->pos += end - start + 1;
+
+    stack_push(&stack, rdstr);
+
+    return stack;
+  }
+
+  struct vector* const str = &ctx->token;
+  str->fill = 0;
+
+  while (1) {
+    const int character = input_getc(stream);
+
+    if (character == EOF) {
+      error("EOF while reading string");
+    }
+
+    if (character == '"') {
+      break;
+    }
+
+    VECTOR_APPEND(str, char, character);
+  }
+
+  rdstr->contents = arena_strndup(&ctx->reader_arena, vector_data(str), vector_length(str));
+
+  stack_push(&stack, rdstr);
+
+  return stack;
+}
+
+static GUESTFUNC(read_error, stack) {
+  error("%s not implemented", __func__);
+  return stack;
+}
+static GUESTFUNC(read_form, stack);
+
+static GUESTFUNC(read_quote, stack) {
+  stack_pop(&stack); // the opening bracket
+  struct input_source* stream = stack_pop(&stack);
+
+  const struct byte_class* const whitespace = reader_class(cprop_whitespace, cprop_error, 1);
+
+  struct rd_quote* const quote = arena_alloc(&ctx->reader_arena, sizeof(*quote));
+  quote->base.type = rd_type_quote;
+  quote->next = NULL;
+  quote->value = NULL;
+
+  struct rd_quote* cell = quote;
+
+  while (1) {
+    stream->pos += class_span(whitespace, stream->data + stream->pos, stream->len - stream->pos);
+
+    const int character = input_getc(stream);
+
+    if (character == ']') {
+      break;
+    }
+
+    if (character == EOF) {
+      error("EOF while reading quotation");
+    }
+
+    if (ctx->readtable->char_properties[toupper(character)] & cprop_whitespace) {
+      continue; // the class_span stopped at the end of the buffer
+    }
+
+    input_ungetc(stream, character);
+
+    stack_push(&stack, &stream);
+    call_guest_function(read_form, &stack);
+
+    void* const form = stack_pop(&stack);
+
+    if (!form) {
+      error("EOF while reading quotation");
+    }
+
+    if (cell->value) {
+      cell->next = arena_alloc(&ctx->reader_arena, sizeof(*cell));
+      cell = cell->next;
+      cell->base.type = rd_type_quote;
+      cell->next = NULL;
+    }
+
+    cell->value = form;
+  }
+
+  stack_push(&stack, quote);
+
+  return stack;
+}
+static GUESTFUNC(read_list, stack) {
+  error("%s not implemented", __func__);
+  return stack;
+}
+
+static GUESTFUNC(read_form, stack) {
+  struct input_source* const stream = *(struct input_source**)stack_pop(&stack);
+
+  reader_classes_check();
+
+  const struct byte_class* const whitespace = reader_class(cprop_whitespace, cprop_error, 1);
+
+  int character = 0;
+
+  // the work done below is to fill this out so we know which function
+  // is appropriate to read the datum, then we call it and return
+  guest_function handler = NULL;
+
+  while (1) {
+    stream->pos += class_span(whitespace, stream->data + stream->pos, stream->len - stream->pos);
+
+    character = input_getc(stream);
+
+    if (character == EOF) {
+      stack_push(&stack, NULL);
+      return stack;
+    }
+
+    character = toupper(character & 0xff);
+
+    const char_prop_t cprop = ctx->readtable->char_properties[character];
+
+    if (cprop & cprop_error) {
+      error("Reader encountered illegal character '%c' (%d)\n", character, character);
+    }
+
+    if (cprop & cprop_whitespace) {
+      continue;
+    }
+
+    if (cprop & cprop_macro) {
+      handler = ctx->readtable->macro_dispatch[character];
+
+      if (!handler) {
+        error("Macro character '%c' (%d) has no handler", character, character);
+      }
+
+      break;
+    }
+
+    if (cprop & cprop_number_init) {
+      handler = read_number;
+      break;
+    }
+
+    if (cprop & cprop_constituent) {
+      handler = read_symbol;
+      break;
+    }
+
+    if (cprop & cprop_number) {
+      error("Encountered number continuation outside of a number");
+    }
+
+    error("Encountered character with no properties '%c' (%d)", character, character);
+  }
+
+  stack_push(&stack, stream);
+  stack_push(&stack, (void*)(uintptr_t)character);
+
+  code_heap_executable();
+  call_guest_function(handler, &stack);
+
+  return stack;
+}
+
+/** Register cache **/
+
+/* While compiling a body the topmost few stack items can be kept in scratch
+ * registers instead of in memory, so that straight-line runs of literals and
+ * inline primitives don't load and store the stack for every operation.
+ * regs[0] holds the deepest cached item and regs[depth - 1] the top of the
+ * stack; everything below that is in memory at rbx as usual. The cache must
+ * be flushed back to memory whenever something else might look at the stack,
+ * i.e. before calls, before running macros and at the end of the body. */
+
+struct regcache {
+  int depth;
+  int regs[ASM_SCRATCH_REGISTERS];
+};
+
+static int regcache_enabled = 1;
+
+static __thread struct regcache regcache;
+
+static void regcache_flush(void) {
+  const int depth = regcache.depth;
+
+  if (depth == 0) {
+    return;
+  }
+
+  ctx->program = asm_adjust(ctx->program, -depth);
+
+  for (int i = 0; i < depth; ++i) {
+    ctx->program = asm_reg_store(ctx->program, depth - 1 - i, regcache.regs[i]);
+  }
+
+  regcache.depth = 0;
+}
+
+static void regcache_spill_bottom(void) {
+  ctx->program = asm_adjust(ctx->program, -1);
+  ctx->program = asm_reg_store(ctx->program, 0, regcache.regs[0]);
+
+  --regcache.depth;
+  memmove(regcache.regs, regcache.regs + 1, sizeof(regcache.regs[0]) * regcache.depth);
+}
+
+static int regcache_push(void) {
+  /* Allocates a register for a new top of stack and returns it */
+
+  if (regcache.depth == ASM_SCRATCH_REGISTERS) {
+    regcache_spill_bottom();
+  }
+
+  unsigned used = 0;
+
+  for (int i = 0; i < regcache.depth; ++i) {
+    used |= 1U << regcache.regs[i];
+  }
+
+  int reg = 0;
+
+  while (used & (1U << reg)) {
+    ++reg;
+  }
+
+  regcache.regs[regcache.depth++] = reg;
+
+  return reg;
+}
+
+static void regcache_fill(const int count) {
+  /* Makes sure at least the top count stack items are in registers */
+
+  const int missing = count - regcache.depth;
+
+  if (missing <= 0) {
+    return;
+  }
+
+  memmove(regcache.regs + missing, regcache.regs, sizeof(regcache.regs[0]) * regcache.depth);
+
+  // regcache_push would put these on top, so pick registers by hand
+  unsigned used = 0;
+
+  for (int i = missing; i < missing + regcache.depth; ++i) {
+    used |= 1U << regcache.regs[i];
+  }
+
+  for (int i = missing - 1, slot = 0; i >= 0; --i, ++slot) {
+    int reg = 0;
+
+    while (used & (1U << reg)) {
+      ++reg;
+    }
+
+    used |= 1U << reg;
+    regcache.regs[i] = reg;
+
+    ctx->program = asm_reg_load(ctx->program, reg, slot);
+  }
+
+  ctx->program = asm_adjust(ctx->program, missing);
+
+  regcache.depth += missing;
+}
+
+static void regcache_push_const(const long value) {
+  unsigned char* const start = ctx->program;
+
+  if (!regcache_enabled) {
+    ctx->program = asm_integer(ctx->program, value);
+  } else {
+    ctx->program = asm_reg_imm(ctx->program, regcache_push(), value);
+  }
+
+  code_note_absolute(start, ctx->program, value);
+}
+
+static int regcache_pop(void) {
+  /* Takes the top of the stack off into a register and flushes the rest, for
+   * control flow that has to have the stack in memory where it joins up.
+   * Returns the register, which is free for anything after the branch. */
+
+  regcache_fill(1);
+
+  const int reg = regcache.regs[--regcache.depth];
+
+  regcache_flush();
+
+  return reg;
+}
+
+static void regcache_drop(void) {
+  if (regcache.depth > 0) {
+    --regcache.depth;
+  } else {
+    ctx->program = asm_pop(ctx->program);
+  }
+}
+
+static void regcache_dup(void) {
+  regcache_fill(1);
+
+  const int top = regcache.regs[regcache.depth - 1];
+
+  ctx->program = asm_reg_mov(ctx->program, regcache_push(), top);
+}
+
+static void regcache_swap(void) {
+  regcache_fill(2);
+
+  const int top = regcache.regs[regcache.depth - 1];
+
+  regcache.regs[regcache.depth - 1] = regcache.regs[regcache.depth - 2];
+  regcache.regs[regcache.depth - 2] = top;
+}
+
+static void regcache_binop(void* (*const emit)(void*, int, int), void* (*const emit_memory)(void*)) {
+  /* Replaces the top two items with emit(second, top). If neither operand is
+   * cached there's nothing to gain from loading them, so just operate on
+   * memory with emit_memory. */
+
+  if (regcache.depth == 0) {
+    ctx->program = emit_memory(ctx->program);
+    return;
+  }
+
+  regcache_fill(2);
+
+  const int top = regcache.regs[regcache.depth - 1];
+  const int second = regcache.regs[regcache.depth - 2];
+
+  ctx->program = emit(ctx->program, second, top);
+
+  --regcache.depth;
+}
+
+static void regcache_add(void) {
+  regcache_binop(asm_reg_add, asm_add);
+}
+
+static void regcache_sub(void) {
+  regcache_binop(asm_reg_sub, asm_sub);
+}
+
+static void regcache_mul(void) {
+  regcache_binop(asm_reg_mul, asm_mul);
+}
+
+static void regcache_add_const(const long value) {
+  if (regcache.depth > 0) {
+    ctx->program = asm_reg_add_imm(ctx->program, regcache.regs[regcache.depth - 1], value);
+  } else {
+    ctx->program = asm_add_imm(ctx->program, value);
+  }
+}
+
+static void regcache_sub_const(const long value) {
+  if (regcache.depth > 0) {
+    ctx->program = asm_reg_sub_imm(ctx->program, regcache.regs[regcache.depth - 1], value);
+  } else {
+    ctx->program = asm_sub_imm(ctx->program, value);
+  }
+}
+
+static void regcache_mul_const(const long value) {
+  if (!regcache_enabled) {
+    ctx->program = asm_integer(ctx->program, value);
+    ctx->program = asm_mul(ctx->program);
+    return;
+  }
+
+  regcache_fill(1);
+
+  ctx->program = asm_reg_mul_imm(ctx->program, regcache.regs[regcache.depth - 1], value);
+}
+
+/** Intermediate representation **/
+
+/* compile doesn't generate code directly, it appends instructions to a buffer
+ * for the definition being compiled. Each instruction is run through a
+ * peephole optimizer on the way in, which folds constants, fuses literals into
+ * the arithmetic that uses them, and drops pairs of instructions that cancel
+ * out. The buffer is lowered to machine code when the definition is finished,
+ * or earlier if something (a macro, say) needs to see *PROGRAM* up to date;
+ * call compile_flush for that.
+ *
+ * A quotation is compiled into the same buffer, and then its instructions are
+ * moved out into ir_blocks and replaced with one that refers to them. While
+ * that's happening ir_floor is where the quotation starts, so the peephole
+ * optimizer doesn't look past it. */
+
+enum ir_op {
+  ir_const, // push value
+  ir_call, // call callee
+  ir_inline, // run prim
+  ir_add_const, // add value to the top of the stack
+  ir_sub_const, // subtract value from the top of the stack
+  ir_mul_const, // multiply the top of the stack by value
+  ir_quote, // push the address of body, compiled as a function
+  ir_if, // pop a flag, then run body if it's nonzero and other if not
+  ir_times, // pop a count and run body that many times
+  ir_while, // run other and pop a flag, and while it's nonzero run body and repeat
+};
+
+struct ir_block {
+  size_t start, count; // in ir_blocks
+};
+
+struct ir_insn {
+  enum ir_op op;
+
+  union {
+    long value;
+    struct symtab* callee;
+    const struct inline_primitive* prim;
+    struct {
+      struct ir_block body, other;
+    };
+  };
+};
+
+static __thread struct vector ir_buffer;
+static __thread struct vector ir_blocks;
+static __thread size_t ir_floor;
+
+static int peephole_enabled = 1;
+
+static const struct inline_primitive inline_drop, inline_dup, inline_swap;
+static const struct inline_primitive inline_mult, inline_add, inline_subtract;
+
+static inline size_t ir_length(void) {
+  return vector_length(&ir_buffer) / sizeof(struct ir_insn);
+}
+
+static inline struct ir_insn* ir_from_end(const size_t n) {
+  /* The nth instruction from the end, starting at 1, or NULL */
+
+  if (ir_length() - ir_floor < n) {
+    return NULL;
+  }
+
+  return &VECTOR_AT(&ir_buffer, struct ir_insn, ir_length() - n);
+}
+
+static inline void ir_pop(const size_t n) {
+  ir_buffer.fill -= n * sizeof(struct ir_insn);
+}
+
+static int ir_is_const(const struct ir_insn* const insn) {
+  return insn && insn->op == ir_const;
+}
+
+static int ir_is_prim(const struct ir_insn* const insn, const struct inline_primitive* const prim) {
+  return insn && insn->op == ir_inline && insn->prim == prim;
+}
+
+static int fits_imm32(const long value) {
+  return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static long fold(const enum ir_op op, const long a, const long b) {
+  /* Computes the same wrapping arithmetic the generated code would */
+
+  switch (op) {
+  case ir_add_const:
+    return (long)((unsigned long)a + (unsigned long)b);
+  case ir_sub_const:
+    return (long)((unsigned long)a - (unsigned long)b);
+  case ir_mul_const:
+    return (long)((unsigned long)a * (unsigned long)b);
+  default:
+    error("Bug");
+    return 0;
+  }
+}
+
+static enum ir_op ir_fused_op(const struct inline_primitive* const prim) {
+  /* The literal-operand version of an arithmetic primitive, or ir_inline if
+   * there isn't one */
+
+  if (prim == &inline_add) return ir_add_const;
+  if (prim == &inline_subtract) return ir_sub_const;
+  if (prim == &inline_mult) return ir_mul_const;
+  return ir_inline;
+}
+
+static void ir_append(struct ir_insn insn) {
+  /* Appends insn, rewriting the end of the buffer if the new instruction lets
+   * us simplify it. A rewrite can produce a new instruction that might allow
+   * further rewrites, so loop until nothing changes. */
+
+  while (peephole_enabled) {
+    struct ir_insn* const last = ir_from_end(1);
+    struct ir_insn* const second = ir_from_end(2);
+
+    if (insn.op == ir_inline) {
+      const enum ir_op fused = ir_fused_op(insn.prim);
+
+      if (fused != ir_inline && ir_is_const(last) && ir_is_const(second)) {
+        // 2 3 + -> 5
+        insn.op = ir_const;
+        insn.value = fold(fused, second->value, last->value);
+        ir_pop(2);
+        continue;
+      }
+
+      if (fused != ir_inline && ir_is_const(last) && fits_imm32(last->value)) {
+        // 3 + -> add 3
+        insn.op = fused;
+        insn.value = last->value;
+        ir_pop(1);
+        continue;
+      }
+
+      if (insn.prim == &inline_drop && last) {
+        if (last->op == ir_const || ir_is_prim(last, &inline_dup)) {
+          // 3 DROP, DUP DROP -> nothing
+          ir_pop(1);
+          return;
+        }
+
+        if (last->op == ir_add_const || last->op == ir_sub_const || last->op == ir_mul_const) {
+          // there's no point doing arithmetic on something we're dropping
+          ir_pop(1);
+          continue;
+        }
+      }
+
+      if (insn.prim == &inline_swap) {
+        if (ir_is_prim(last, &inline_swap)) {
+          // SWAP SWAP -> nothing
+          ir_pop(1);
+          return;
+        }
+
+        if (ir_is_const(last) && ir_is_const(second)) {
+          // 2 3 SWAP -> 3 2
+          const long value = last->value;
+          last->value = second->value;
+          second->value = value;
+          return;
+        }
+      }
+
+      if (insn.prim == &inline_dup && ir_is_const(last)) {
+        // 3 DUP -> 3 3
+        insn = *last;
+        continue;
+      }
+    }
+
+    if (insn.op == ir_add_const || insn.op == ir_sub_const || insn.op == ir_mul_const) {
+      if (ir_is_const(last)) {
+        // can happen after a DROP took out the instruction in between
+        insn.value = fold(insn.op, last->value, insn.value);
+        insn.op = ir_const;
+        ir_pop(1);
+        continue;
+      }
+
+      if (last && last->op == insn.op && insn.op != ir_sub_const) {
+        // add 1 add 2 -> add 3, mul 2 mul 3 -> mul 6
+        const long value = fold(insn.op, last->value, insn.value);
+
+        if (fits_imm32(value)) {
+          insn.value = value;
+          ir_pop(1);
+          continue;
+        }
+      }
+
+      if ((insn.op != ir_mul_const && insn.value == 0) || (insn.op == ir_mul_const && insn.value == 1)) {
+        // add 0, mul 1 -> nothing
+        return;
+      }
+    }
+
+    break;
+  }
+
+  VECTOR_APPEND(&ir_buffer, struct ir_insn, insn);
+}
+
+static void branch_patch(void* const end, const void* const target) {
+  if (!asm_patch_jump(end, target)) {
+    error("Branch out of range in the code heap");
+  }
+}
+
+static void ir_lower_block(const struct ir_block* block);
+static void* ir_lower_quote(const struct ir_block* block);
+
+static void ir_lower(const struct ir_insn* const insn) {
+  switch (insn->op) {
+  case ir_const:
+    regcache_push_const(insn->value);
+    break;
+  case ir_call:
+    regcache_flush();
+    {
+      const void* const target = code_reach(insn->callee->symbol_value);
+
+      ctx->program = asm_guest_call(ctx->program);
+
+      unsigned char* const call = ctx->program;
+
+      record_call_site(insn->callee, call, target);
+      ctx->program = asm_call(call, target);
+      ctx->program = asm_guest_return(ctx->program);
+    }
+    break;
+  case ir_inline:
+    if (regcache_enabled) {
+      insn->prim->emit_cached();
+    } else {
+      ctx->program = insn->prim->emit(ctx->program);
+    }
+    break;
+  case ir_add_const:
+    regcache_add_const(insn->value);
+    break;
+  case ir_sub_const:
+    regcache_sub_const(insn->value);
+    break;
+  case ir_mul_const:
+    regcache_mul_const(insn->value);
+    break;
+  case ir_quote:
+    regcache_push_const((intptr_t)ir_lower_quote(&insn->body));
+    break;
+  case ir_if:
+    {
+      const int flag = regcache_pop();
+      unsigned char* const skip = ctx->program = asm_jump_if_zero(ctx->program, flag);
+
+      ir_lower_block(&insn->body);
+
+      if (insn->other.count > 0) {
+        unsigned char* const done = ctx->program = asm_jump(ctx->program);
+
+        branch_patch(skip, ctx->program);
+        ir_lower_block(&insn->other);
+        branch_patch(done, ctx->program);
+      } else {
+        branch_patch(skip, ctx->program);
+      }
+    }
+    break;
+  case ir_times:
+    {
+      const int count = regcache_pop();
+
+      ctx->program = asm_loop_start(ctx->program, count);
+
+      unsigned char* const test = ctx->program = asm_jump(ctx->program);
+      unsigned char* const top = ctx->program;
+
+      ir_lower_block(&insn->body);
+
+      branch_patch(test, ctx->program);
+      ctx->program = asm_loop_next(ctx->program);
+      branch_patch(ctx->program, top);
+      ctx->program = asm_loop_end(ctx->program);
+    }
+    break;
+  case ir_while:
+    {
+      regcache_flush();
+
+      unsigned char* const test = ctx->program = asm_jump(ctx->program);
+      unsigned char* const top = ctx->program;
+
+      ir_lower_block(&insn->body);
+
+      branch_patch(test, ctx->program);
+
+      for (size_t i = 0; i < insn->other.count; ++i) {
+        code_reserve(CODE_HEAP_SLACK);
+        ir_lower(&VECTOR_AT(&ir_blocks, struct ir_insn, insn->other.start + i));
+      }
+
+      code_reserve(CODE_HEAP_SLACK);
+
+      const int flag = regcache_pop();
+
+      ctx->program = asm_jump_if_nonzero(ctx->program, flag);
+      branch_patch(ctx->program, top);
+    }
+    break;
+  }
+}
+
+static void ir_lower_block(const struct ir_block* const block) {
+  /* Lowers the instructions of a quotation in line, leaving the stack in
+   * memory and room for a branch after them */
+
+  for (size_t i = 0; i < block->count; ++i) {
+    code_reserve(CODE_HEAP_SLACK);
+    ir_lower(&VECTOR_AT(&ir_blocks, struct ir_insn, block->start + i));
+  }
+
+  code_reserve(CODE_HEAP_SLACK);
+  regcache_flush();
+}
+
+static void* ir_lower_quote(const struct ir_block* const block) {
+  /* Lowers a quotation out of line, as a function of its own that the code
+   * around it jumps over, and returns its address */
+
+  const struct regcache outer = regcache;
+  regcache.depth = 0;
+
+  code_reserve(CODE_HEAP_SLACK);
+
+  unsigned char* const over = ctx->program = asm_jump(ctx->program);
+
+  code_align();
+
+  void* const start = ctx->program;
+  ctx->program = asm_prologue(ctx->program);
+
+  ir_lower_block(block);
+
+  ctx->program = asm_epilogue(ctx->program, 0);
+  ctx->program = asm_ret(ctx->program);
+
+  branch_patch(over, ctx->program);
+
+  regcache = outer;
+
+  return start;
+}
+
+static void compile_flush(void) {
+  /* Generates code for everything compiled so far and leaves the stack in
+   * memory, so that *PROGRAM* and the stack are what the guest expects */
+
+  for (size_t i = 0; i < ir_length(); ++i) {
+    code_reserve(CODE_HEAP_SLACK);
+    ir_lower(&VECTOR_AT(&ir_buffer, struct ir_insn, i));
+  }
+
+  ir_buffer.fill = 0;
+  ir_blocks.fill = 0;
+
+  code_reserve(CODE_HEAP_SLACK);
+  regcache_flush();
+}
+
+static struct symtab* compile_take_tail_call(void) {
+  /* If the last thing compiled was a call, takes it back out and returns the
+   * function it calls, so the caller can jump there instead */
+
+  const struct ir_insn* const last = ir_from_end(1);
+
+  if (!last || last->op != ir_call) {
+    return NULL;
+  }
+
+  struct symtab* const callee = last->callee;
+  ir_pop(1);
+
+  return callee;
+}
+
+static void compile_const(const long value) {
+  const struct ir_insn insn = { .op = ir_const, .value = value };
+  ir_append(insn);
+}
+
+/** Compiler **/
+
+static __thread int compile_immediate; // whether the definition being compiled is immediate
+static __thread int compile_quote_depth; // how many quotations are being compiled right now
+
+static char* promote_string(const char* const contents) {
+  /* String literals that escape into compiled code or onto the stack have to
+   * outlive the reader arena */
+  return arena_strndup(&ctx->permanent_arena, contents, strlen(contents));
+}
+
+/* The control flow words. They work on quotations that turn up at run time,
+ * but when compile sees their quotations as literals right before them it
+ * lowers them in line with real branches instead; see compile_control. Like
+ * inline primitives, code compiled that way isn't affected by redefining the
+ * word later on. */
+static GUESTFUNC(quote_call, stack);
+static GUESTFUNC(quote_if, stack);
+static GUESTFUNC(quote_times, stack);
+static GUESTFUNC(quote_while, stack);
+
+static void compile_inline_block(const struct ir_block block) {
+  for (size_t i = 0; i < block.count; ++i) {
+    ir_append(VECTOR_AT(&ir_blocks, struct ir_insn, block.start + i));
+  }
+}
+
+static int compile_control(const struct symtab* const callee) {
+  /* Compiles a call to callee in line if it's a control flow word with
+   * literal quotations, returning nonzero if it did */
+
+  const void* const fn = callee->symbol_value;
+  const struct ir_insn* const last = ir_from_end(1);
+  const struct ir_insn* const second = ir_from_end(2);
+  const struct ir_insn* const third = ir_from_end(3);
+
+  const int one = last && last->op == ir_quote;
+  const int two = one && second && second->op == ir_quote;
+
+  struct ir_insn insn;
+
+  if (fn == quote_call && one) {
+    // [ 1 + ] CALL -> 1 +
+    insn = *last;
+    ir_pop(1);
+    compile_inline_block(insn.body);
+    return 1;
+  } else if (fn == quote_if && two && ir_is_const(third)) {
+    // 1 [ A ] [ B ] IF -> A
+    insn.body = third->value ? second->body : last->body;
+    ir_pop(3);
+    compile_inline_block(insn.body);
+    return 1;
+  } else if (fn == quote_if && two) {
+    insn.op = ir_if;
+    insn.body = second->body;
+    insn.other = last->body;
+    ir_pop(2);
+  } else if (fn == quote_times && one) {
+    insn.op = ir_times;
+    insn.body = last->body;
+    ir_pop(1);
+  } else if (fn == quote_while && two) {
+    insn.op = ir_while;
+    insn.other = second->body;
+    insn.body = last->body;
+    ir_pop(2);
+  } else {
+    return 0;
+  }
+
+  ir_append(insn);
+  return 1;
+}
+
+static GUESTFUNC(compile, stack);
+
+static void compile_quote(const struct rd_quote* const quote, void** stack) {
+  /* Compiles the forms in quote and appends an ir_quote for them */
+
+  const size_t outer_floor = ir_floor;
+
+  ir_floor = ir_length();
+  ++compile_quote_depth;
+
+  for (const struct rd_quote* cell = quote; cell && cell->value; cell = cell->next) {
+    stack_push(&stack, cell->value);
+    call_guest_function(compile, &stack);
+  }
+
+  const size_t count = ir_length() - ir_floor;
+  const struct ir_block body = { vector_length(&ir_blocks) / sizeof(struct ir_insn), count };
+
+  if (count > 0) {
+    memcpy(vector_append(&ir_blocks, count * sizeof(struct ir_insn)),
+           &VECTOR_AT(&ir_buffer, struct ir_insn, ir_floor),
+           count * sizeof(struct ir_insn));
+    ir_pop(count);
+  }
+
+  --compile_quote_depth;
+  ir_floor = outer_floor;
+
+  const struct ir_insn insn = { .op = ir_quote, .body = body };
+  ir_append(insn);
+}
+
+static void* compile_quote_now(const struct rd_quote* const quote, void** const stack) {
+  /* Compiles quote into a function of its own straight away and returns its
+   * address */
+
+  compile_quote(quote, stack);
+
+  const struct ir_insn insn = *ir_from_end(1);
+  ir_pop(1);
+
+  void* const start = ir_lower_quote(&insn.body);
+
+  if (ir_length() == 0) {
+    ir_blocks.fill = 0;
+  }
+
+  return start;
+}
+
+static void compile_binding(struct symtab* const obj) {
+  /* Compiles a reference to anything but a macro */
+
+  switch (obj->symbol_type) {
+  case symtype_function:
+    {
+      struct symtab* callee = obj;
+
+      // a lazy definition can refer to functions that have been redefined
+      // since it was read, and it has to behave as if it was compiled then
+      while (callee->redefinition) {
+        callee = callee->redefinition;
+      }
+
+      compile_immediate |= callee->immediate;
+
+      if (compile_control(callee)) {
+        break;
+      }
+
+      const struct ir_insn insn = { .op = ir_call, .callee = callee };
+      ir_append(insn);
+    }
+    break;
+  case symtype_value:
+    compile_const((intptr_t)obj->symbol_value);
+    break;
+  case symtype_inline:
+    {
+      const struct ir_insn insn = { .op = ir_inline, .prim = obj->symbol_value };
+      ir_append(insn);
+    }
+    break;
+  default:
+    error("Bug");
+  }
+}
+
+static GUESTFUNC(compile, stack) {
+  /* compile: obj -> 
+
+     Appends code for obj to the definition being compiled. Nothing is
+     actually generated until compile_flush is called. */
+
+  union rd_any* const rdobj = stack_pop(&stack);
+
+  switch (rdobj->base.type) {
+  case rd_type_symbol:
+    {
+      struct symtab* const obj = atom_binding(&rdobj->sym, ctx->symbol_table);
+
+      if (!obj) {
+        error("The name '%s' is undefined", rdobj->sym.repr);
+      }
+
+      if (obj->symbol_type == symtype_macro) {
+        if (compile_quote_depth > 0) {
+          error("Macro '%s' can't be used in a quotation", rdobj->sym.repr);
+        }
+
+        // there's no telling what the macro put in the definition
+        compile_immediate = 1;
+
+        compile_flush();
+        code_heap_executable();
+        call_guest_function(obj->symbol_value, &stack);
+      } else {
+        compile_binding(obj);
+      }
+    }
+    break;
+  case rd_type_number:
+    compile_const(rdobj->num.value);
+    break;
+  case rd_type_string:
+    compile_const((intptr_t)promote_string(rdobj->str.contents));
+    break;
+  case rd_type_quote:
+    compile_quote(&rdobj->quote, stack);
+    break;
+  case rd_type_cons:
+    error("unimplemented");
+  }
+
+  return stack;
+}
+
+/** Evaluator **/
+
+static void eval_resolve(struct rd_symbol* const sym) {
+  /* Works out eval's memo for sym; see struct rd_symbol */
+
+  struct symtab* const obj = atom_binding(sym, ctx->symbol_table);
+
+  if (!obj) {
+    error("The name '%s' is undefined", sym->repr);
+  }
+
+  sym->eval_function = NULL;
+  sym->eval_value = NULL;
+
+  switch (obj->symbol_type) {
+  case symtype_macro:
+  case symtype_function:
+    sym->eval_function = obj->symbol_value;
+    break;
+  case symtype_value:
+    sym->eval_value = obj->symbol_value;
+    break;
+  case symtype_inline:
+    sym->eval_function = ((const struct inline_primitive*)obj->symbol_value)->function;
+    break;
+  }
+
+  // after the lookup, which can rebind everything and so bump the epoch
+  sym->eval_epoch = ctx->atoms->epoch;
+}
+
+static GUESTFUNC(eval, stack) {
+  /* eval: obj -> ?  
+
+     The eval() function doesn't modify the stack in its own right,
+     but simply evaluates its argument and leaves its results on the
+     stack.
+  */
+
+  union rd_any* const rdobj = stack_pop(&stack);
+
+  switch (rdobj->base.type) {
+  case rd_type_symbol:
+    {
+      struct rd_symbol* const sym = &rdobj->sym;
+
+      if (sym->eval_epoch != ctx->atoms->epoch) {
+        eval_resolve(sym);
+      }
+
+      if (sym->eval_function) {
+        code_heap_executable();
+        call_guest_function(sym->eval_function, &stack);
+      } else {
+        stack_push(&stack, sym->eval_value);
+      }
+    }
+    break;
+  case rd_type_number:
+    stack_push(&stack, (void*)rdobj->num.value);
+    break;
+  case rd_type_string:
+    stack_push(&stack, promote_string(rdobj->str.contents));
+    break;
+  case rd_type_quote:
+    stack_push(&stack, compile_quote_now(&rdobj->quote, stack));
+    break;
+  case rd_type_cons:
+    error("unimplemented");
+  }
+
+  return stack;
+}
+
+/** Some intrinsics **/
+
+static GUESTFUNC(duplicate, stack) {
+  void* const value = *stack;
+  stack_push(&stack, value);
+  return stack;
+}
+
+static GUESTFUNC(drop, stack) {
+  stack_pop(&stack);
+  return stack;
+}
+
+static GUESTFUNC(swap, stack) {
+  void* const value0 = stack[0];
+  void* const value1 = stack[1];
+  stack[1] = value0;
+  stack[0] = value1;
+  return stack;
+}
+
+static GUESTFUNC(mult, stack) {
+  const long a = (long)stack_pop(&stack),
+             b = (long)stack_pop(&stack);
+  
+  stack_push(&stack, (void*)(a * b));
+  return stack;
+}
+
+static GUESTFUNC(add, stack) {
+  const long a = (long)stack_pop(&stack),
+             b = (long)stack_pop(&stack);
+  
+  stack_push(&stack, (void*)(a + b));
+  return stack;
+}
+
+static GUESTFUNC(subtract, stack) {
+  const long a = (long)stack_pop(&stack),
+             b = (long)stack_pop(&stack);
+  
+  stack_push(&stack, (void*)(b - a));
+  return stack;
+}
+
+static const struct inline_primitive inline_drop = { drop, asm_pop, regcache_drop };
+static const struct inline_primitive inline_dup = { duplicate, asm_dup, regcache_dup };
+static const struct inline_primitive inline_swap = { swap, asm_swap, regcache_swap };
+static const struct inline_primitive inline_mult = { mult, asm_mul, regcache_mul };
+static const struct inline_primitive inline_add = { add, asm_add, regcache_add };
+static const struct inline_primitive inline_subtract = { subtract, asm_sub, regcache_sub };
+
+static GUESTFUNC(print_int, stack) {
+  const long a = (long)stack_pop(&stack);
+
+  output_long(ctx->output, a);
+  output_char(ctx->output, '\n');
+  
+  return stack;
+}
+
+static GUESTFUNC(print_string, stack) {
+  const char* const s = stack_pop(&stack);
+
+  output_write(ctx->output, s, strlen(s));
+  output_char(ctx->output, '\n');
+  
+  return stack;
+}
+
+static GUESTFUNC(read_ptr, stack) {
+  void** const ptr = stack_pop(&stack);
+  stack_push(&stack, *ptr);
+  
+  return stack;
+}
+
+static GUESTFUNC(write_ptr, stack) {
+  void* const value = stack_pop(&stack);
+  void** const ptr = stack_pop(&stack);
+
+  *ptr = value;
+  definitions_changed();
+
+  return stack;
+}
+
+static GUESTFUNC(allocatemem, stack) {
+  const long amt = (long)stack_pop(&stack);
+
+  memstat_note(memstat_guest, amt);
+  stack_push(&stack, malloc(amt));
+
+  return stack;
+}
+
+/** Control flow **/
+
+/* A quotation on the stack is the address of its compiled code; see
+ * compile_control for how these usually get compiled instead */
+
+static GUESTFUNC(quote_call, stack) {
+  /* call: quotation -> ? */
+
+  void* const quote = stack_pop(&stack);
+  call_guest_function(quote, &stack);
+
+  return stack;
+}
+
+static GUESTFUNC(quote_if, stack) {
+  /* if: flag then else -> ? */
+
+  void* const other = stack_pop(&stack);
+  void* const body = stack_pop(&stack);
+  const long flag = (long)stack_pop(&stack);
+
+  call_guest_function(flag ? body : other, &stack);
+
+  return stack;
+}
+
+static GUESTFUNC(quote_times, stack) {
+  /* times: count quotation -> ? */
+
+  void* const body = stack_pop(&stack);
+  const long count = (long)stack_pop(&stack);
+
+  for (long i = 0; i < count; ++i) {
+    call_guest_function(body, &stack);
+  }
+
+  return stack;
+}
+
+static GUESTFUNC(quote_while, stack) {
+  /* while: condition body -> ? */
+
+  void* const body = stack_pop(&stack);
+  void* const condition = stack_pop(&stack);
+
+  while (1) {
+    call_guest_function(condition, &stack);
+
+    if (!stack_pop(&stack)) {
+      break;
+    }
+
+    call_guest_function(body, &stack);
+  }
+
+  return stack;
+}
+
+/** Timing **/
+
+/* RDTSC and NOW are for timing things by hand. BENCH runs a quotation over
+ * and over and prints what each run took in the same "bench <name> <value>
+ * <unit>" lines as bench/run.sh, so that kernels can be timed without the
+ * startup, reading and compiling that timing the whole process takes in. */
+
+#define BENCH_SAMPLES 100
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static GUESTFUNC(read_tsc, stack) {
+  /* rdtsc: -> cycles */
+
+  unsigned int aux;
+
+  // rdtscp waits for everything before it to finish
+  stack_push(&stack, (void*)(uintptr_t)__rdtscp(&aux));
+
+  return stack;
+}
+
+static GUESTFUNC(now, stack) {
+  /* now: -> nanoseconds, from an arbitrary start that never goes backwards */
+
+  stack_push(&stack, (void*)(uintptr_t)monotonic_ns());
+
+  return stack;
+}
+
+static int bench_compare(const void* const a, const void* const b) {
+  const double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+static GUESTFUNC(bench, stack) {
+  /* bench: name iterations quotation -> */
+
+  void* const body = stack_pop(&stack);
+  const long iterations = (long)stack_pop(&stack);
+  const char* const name = stack_pop(&stack);
+
+  if (iterations <= 0) {
+    error("BENCH needs a positive number of iterations, not %ld", iterations);
+  }
+
+  void** const before = stack;
+
+  call_guest_function(body, &stack);
+
+  if (stack != before) {
+    error("BENCH of '%s': the quotation has to leave the stack as it found it", name);
+  }
+
+  // the first runs pay for page faults, lazy compilation and cold caches
+  for (long i = 0; i < iterations / 10; ++i) {
+    call_guest_function(body, &stack);
+  }
+
+  // timed in batches so that reading the clock doesn't swamp small bodies
+  const long samples = iterations < BENCH_SAMPLES ? iterations : BENCH_SAMPLES;
+  double per_iteration[BENCH_SAMPLES];
+
+  for (long s = 0; s < samples; ++s) {
+    const long batch = iterations / samples + (s < iterations % samples);
+    const uint64_t start = monotonic_ns();
+
+    for (long i = 0; i < batch; ++i) {
+      call_guest_function(body, &stack);
+    }
+
+    per_iteration[s] = (double)(monotonic_ns() - start) / batch;
+  }
+
+  qsort(per_iteration, samples, sizeof(*per_iteration), bench_compare);
+
+  output_printf(ctx->output, "bench %s-min %.2f ns/iter\n", name, per_iteration[0]);
+  output_printf(ctx->output, "bench %s-median %.2f ns/iter\n", name, per_iteration[samples / 2]);
+  // nearest rank, so that with 100 samples p99 isn't just the slowest
+  output_printf(ctx->output, "bench %s-p99 %.2f ns/iter\n", name, per_iteration[(samples * 99 + 99) / 100 - 1]);
+
+  return stack;
+}
+
+/** Regions and bulk memory **/
+
+/* A region is an arena that guest code can allocate from and then reset or
+ * free all at once, instead of leaking everything it ALLOCs */
+
+static GUESTFUNC(region_new, stack) {
+  /* region: -> region */
+
+  struct arena* const region = calloc(sizeof(*region), 1);
+
+  if (!region) {
+    error("Failed to allocate a region");
+  }
+
+  stack_push(&stack, region);
+
+  return stack;
+}
+
+static GUESTFUNC(region_alloc, stack) {
+  /* region-alloc: region size -> pointer */
+
+  const long size = (long)stack_pop(&stack);
+  struct arena* const region = stack_pop(&stack);
+
+  if (size < 0) {
+    error("Can't allocate %ld bytes from a region", size);
+  }
+
+  stack_push(&stack, arena_alloc(region, size));
+
+  return stack;
+}
+
+static GUESTFUNC(region_reset, stack) {
+  /* region-reset: region ->
+
+     Frees everything allocated from region, keeping its memory for reuse */
+
+  const struct arena_mark empty = { NULL, NULL };
+  arena_release(stack_pop(&stack), empty);
+
+  return stack;
+}
+
+static GUESTFUNC(region_free, stack) {
+  /* region-free: region -> */
+
+  struct arena* const region = stack_pop(&stack);
+
+  arena_free(region);
+  free(region);
+
+  return stack;
+}
+
+static void fill_scalar(uint64_t* const dst, const uint64_t pattern, const size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    dst[i] = pattern;
+  }
+}
+
+__attribute__((target("avx2")))
+static void fill_avx2(uint64_t* const dst, const uint64_t pattern, const size_t count) {
+  const __m256i wide = _mm256_set1_epi64x(pattern);
+  size_t i = 0;
+
+  for (; i + 16 <= count; i += 16) {
+    _mm256_storeu_si256((__m256i*)(dst + i), wide);
+    _mm256_storeu_si256((__m256i*)(dst + i + 4), wide);
+    _mm256_storeu_si256((__m256i*)(dst + i + 8), wide);
+    _mm256_storeu_si256((__m256i*)(dst + i + 12), wide);
+  }
+
+  for (; i + 4 <= count; i += 4) {
+    _mm256_storeu_si256((__m256i*)(dst + i), wide);
+  }
+
+  fill_scalar(dst + i, pattern, count - i);
+}
+
+static long bulk_size(const long size) {
+  if (size < 0) {
+    error("Negative size %ld for a bulk memory operation", size);
+  }
+
+  return size;
+}
+
+static GUESTFUNC(mem_copy, stack) {
+  /* memcpy: destination source size ->
+
+     The two may overlap */
+
+  const long size = bulk_size((long)stack_pop(&stack));
+  const void* const src = stack_pop(&stack);
+  void* const dst = stack_pop(&stack);
+
+  memmove(dst, src, size);
+  definitions_changed();
+
+  return stack;
+}
+
+static GUESTFUNC(mem_set, stack) {
+  /* memset: destination byte size -> */
+
+  const long size = bulk_size((long)stack_pop(&stack));
+  const int byte = (int)(long)stack_pop(&stack);
+  void* const dst = stack_pop(&stack);
+
+  memset(dst, byte, size);
+  definitions_changed();
+
+  return stack;
+}
+
+static GUESTFUNC(mem_fill, stack) {
+  /* fill: destination word count ->
+
+     Stores word into count consecutive words */
+
+  const long count = bulk_size((long)stack_pop(&stack));
+  const uint64_t pattern = (uint64_t)stack_pop(&stack);
+  uint64_t* const dst = stack_pop(&stack);
+
+  if ((unsigned long)count > LONG_MAX / sizeof(*dst)) {
+    error("Can't fill %ld words", count);
+  }
+
+  if (pattern == (pattern & 0xff) * 0x0101010101010101ULL) {
+    // the same byte all over, which memset does best
+    memset(dst, pattern & 0xff, count * sizeof(*dst));
+  } else if (fill_vector) {
+    fill_vector(dst, pattern, count);
+  } else {
+    fill_scalar(dst, pattern, count);
+  }
+
+  definitions_changed();
+
+  return stack;
+}
+
+static GUESTFUNC(flush, stack) {
+  /* flush: -> */
+
+  output_flush(ctx->output);
+
+  return stack;
+}
+
+static GUESTFUNC(fd_out, stack) {
+  /* fd-out: fd -> output */
+
+  const long fd = (long)stack_pop(&stack);
+
+  stack_push(&stack, output_new(fd));
+
+  return stack;
+}
+
+static GUESTFUNC(file_out, stack) {
+  /* file-out: path -> output */
+
+  const char* const path = stack_pop(&stack);
+  const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+  if (fd < 0) {
+    error("Could not open '%s' for output: %s", path, strerror(errno));
+  }
+
+  stack_push(&stack, output_new(fd));
+
+  return stack;
+}
+
+static GUESTFUNC(close_out, stack) {
+  /* close-out: output -> */
+
+  struct output* const out = stack_pop(&stack);
+
+  if (out == ctx->output) {
+    error("Can't close *OUT*");
+  }
+
+  output_close(out);
+
+  return stack;
+}
+
+/* The globals guest code can get at are fields of ctx, so each of them is a
+ * word that pushes the address of the running context's field */
+
+#define CONTEXT_GLOBAL(NAME, FIELD)             \
+  static GUESTFUNC(NAME, stack) {               \
+    stack_push(&stack, &ctx->FIELD);            \
+    return stack;              \
+  }
+
+CONTEXT_GLOBAL(global_symtab, symbol_table)
+CONTEXT_GLOBAL(global_readtab, readtable)
+CONTEXT_GLOBAL(global_in, input)
+CONTEXT_GLOBAL(global_out, output)
+CONTEXT_GLOBAL(global_program, program)
+
+/** Telling perf about compiled code **/
+
+/* With --perf-map, every compiled word gets a line in /tmp/perf-<pid>.map so
+ * perf report can name it. With --jitdump, the code itself goes into
+ * /tmp/jit-<pid>.dump too, which perf inject can turn into something perf
+ * annotate understands:
+ *
+ *   perf record -k mono ./simple --jitdump ...
+ *   perf inject --jit -i perf.data -o perf.jit.data
+ *
+ * Top-level thunks aren't reported, since their code gets reused. */
+
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JITDUMP_CODE_LOAD 0
+#define JITDUMP_EM_X86_64 62
+
+struct jitdump_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t total_size;
+  uint32_t elf_mach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+};
+
+struct jitdump_code_load {
+  uint32_t id;
+  uint32_t total_size;
+  uint64_t timestamp;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+  // followed by the name, NUL terminated, and then the code
+};
+
+static int perf_map_enabled = 0;
+static int jitdump_enabled = 0;
+
+static FILE* perf_map;
+static FILE* jitdump;
+static uint64_t jitdump_index;
+static pthread_mutex_t perf_lock = PTHREAD_MUTEX_INITIALIZER; // for workers, see -j
+
+static uint64_t perf_timestamp(void) {
+  // perf record -k mono uses the same clock
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void perf_init(void) {
+  char path[64];
+
+  if (perf_map_enabled) {
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    perf_map = fopen(path, "w");
+
+    if (!perf_map) {
+      error("Could not open '%s': %s", path, strerror(errno));
+    }
+  }
+
+  if (jitdump_enabled) {
+    snprintf(path, sizeof(path), "/tmp/jit-%d.dump", (int)getpid());
+
+    const int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0666);
+
+    if (fd < 0 || !(jitdump = fdopen(fd, "w+"))) {
+      error("Could not open '%s': %s", path, strerror(errno));
+    }
+
+    // perf record finds the dump by seeing it get mapped executable
+    if (mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0) == MAP_FAILED) {
+      error("Failed to map '%s': %s", path, strerror(errno));
+    }
+
+    const struct jitdump_header header = {
+      .magic = JITDUMP_MAGIC,
+      .version = JITDUMP_VERSION,
+      .total_size = sizeof(header),
+      .elf_mach = JITDUMP_EM_X86_64,
+      .pid = getpid(),
+      .timestamp = perf_timestamp(),
+    };
+
+    fwrite(&header, sizeof(header), 1, jitdump);
+  }
+}
+
+static void perf_note_code(const char* const name, const void* const start, const void* const end) {
+  const size_t size = (const char*)end - (const char*)start;
+
+  if (!perf_map && !jitdump) {
+    return;
+  }
+
+  pthread_mutex_lock(&perf_lock);
+
+  if (perf_map) {
+    fprintf(perf_map, "%lx %lx %s\n", (unsigned long)start, (unsigned long)size, name);
+  }
+
+  if (jitdump) {
+    const size_t name_size = strlen(name) + 1;
+
+    const struct jitdump_code_load record = {
+      .id = JITDUMP_CODE_LOAD,
+      .total_size = sizeof(record) + name_size + size,
+      .timestamp = perf_timestamp(),
+      .pid = getpid(),
+      .tid = syscall(SYS_gettid),
+      .vma = (uintptr_t)start,
+      .code_addr = (uintptr_t)start,
+      .code_size = size,
+      .code_index = jitdump_index++,
+    };
+
+    fwrite(&record, sizeof(record), 1, jitdump);
+    fwrite(name, name_size, 1, jitdump);
+    fwrite(start, size, 1, jitdump);
+  }
+
+  pthread_mutex_unlock(&perf_lock);
+}
+
+/** Profiler **/
+
+/* With --profile, every compiled word counts its calls and the time stamp
+ * counter cycles spent in it, including in anything it calls, and
+ * PROFILE-REPORT prints the words sorted by cycles. A word that ends in a tail
+ * call stops counting when it jumps. Without --profile the prologue and
+ * epilogue are the plain ones. With -j, the counters of words in the prelude
+ * are shared by all the workers and aren't updated atomically, so they can
+ * come up short. */
+
+struct profile_counter {
+  struct slist list;
+  char* name; // owning pointer
+  uint64_t calls;
+  uint64_t cycles;
+};
+
+static int profile_enabled = 0;
+
+static struct profile_counter* profile_counters; // newest first
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct profile_counter* profile_counter_new(const char* const name) {
+  /* Returns a counter for a new definition of name, or NULL if we're not
+   * profiling */
+
+  if (!profile_enabled) {
+    return NULL;
+  }
+
+  struct profile_counter* const counter = calloc(sizeof(*counter), 1);
+  counter->name = strdup(name);
+
+  pthread_mutex_lock(&profile_lock);
+  slist_push(&profile_counters->list, &counter->list);
+  profile_counters = counter;
+  pthread_mutex_unlock(&profile_lock);
+
+  return counter;
+}
+
+static int profile_compare(const void* const a, const void* const b) {
+  const struct profile_counter* const x = *(struct profile_counter* const*)a;
+  const struct profile_counter* const y = *(struct profile_counter* const*)b;
+
+  return x->cycles < y->cycles ? 1 : x->cycles > y->cycles ? -1 : 0;
+}
+
+static GUESTFUNC(profile_report, stack) {
+  /* profile-report: -> */
+
+  if (!profile_enabled) {
+    fprintf(stderr, "PROFILE-REPORT: not profiling, run with --profile\n");
+    return stack;
+  }
+
+  // counters are only ever pushed onto the front, so everything from here
+  // on stays put
+  pthread_mutex_lock(&profile_lock);
+  struct profile_counter* const counters = profile_counters;
+  pthread_mutex_unlock(&profile_lock);
+
+  size_t count = 0;
+
+  for (const struct profile_counter* c = counters; c; c = c->list.next) {
+    count += c->calls > 0;
+  }
+
+  struct profile_counter** const sorted = calloc(sizeof(*sorted), count + 1);
+
+  {
+    size_t i = 0;
+
+    // other threads can start calling things in the meantime
+    for (struct profile_counter* c = counters; c && i < count; c = c->list.next) {
+      if (c->calls > 0) {
+        sorted[i++] = c;
+      }
+    }
+  }
+
+  qsort(sorted, count, sizeof(*sorted), profile_compare);
+
+  output_printf(ctx->output, "%20s %12s %12s  %s\n", "cycles", "calls", "cycles/call", "word");
+
+  for (size_t i = 0; i < count; ++i) {
+    output_printf(ctx->output, "%20llu %12llu %12llu  %s\n",
+            (unsigned long long)sorted[i]->cycles,
+            (unsigned long long)sorted[i]->calls,
+            (unsigned long long)(sorted[i]->cycles / sorted[i]->calls),
+            sorted[i]->name);
+  }
+
+  free(sorted);
+
+  return stack;
+}
+
+/** Memory statistics **/
+
+/* MEMSTATS prints the allocation counters along with how much of the code
+ * heap and the data stack the context has used. The data stack's high-water
+ * mark comes from which of its pages have ever been touched, so it's only good
+ * to the page, but it costs nothing until someone asks. With --memstats the
+ * same report goes to stderr at exit. */
+
+static int memstats_at_exit = 0;
+
+static size_t arena_held(const struct arena* const a) {
+  /* Returns the bytes in a's chunks, in use or spare */
+
+  size_t held = 0;
+
+  for (const struct arena_chunk* c = a->chunk; c; c = c->prev) {
+    held += c->end - c->data;
+  }
+
+  for (const struct arena_chunk* c = a->spare; c; c = c->prev) {
+    held += c->end - c->data;
+  }
+
+  return held;
+}
+
+static size_t stack_high_water(void) {
+  /* Returns how deep ctx's data stack has ever been, rounded up to a page */
+
+  const size_t page = sysconf(_SC_PAGESIZE);
+  char* const base = (char*)ctx->stack_base;
+  const size_t pages = ((char*)ctx->stack_top - base) / page;
+
+  unsigned char* const resident = malloc(pages + 1);
+
+  if (!resident || mincore(base, pages * page, resident) != 0) {
+    free(resident);
+    return 0;
+  }
+
+  size_t lowest = pages;
+
+  // the stack grows down, so the deepest page touched is the lowest one
+  for (size_t i = pages; i-- > 0; ) {
+    if (resident[i] & 1) {
+      lowest = i;
+    }
+  }
+
+  free(resident);
+
+  return (pages - lowest) * page;
+}
+
+static void memstats_print(struct output* const out, void** const stack) {
+  output_printf(out, "%-14s %12s %14s %14s\n", "allocated", "count", "bytes", "live");
+
+  for (int i = 0; i < memstat_sites; ++i) {
+    const struct memstat stat = {
+      __atomic_load_n(&memstats[i].allocations, __ATOMIC_RELAXED),
+      __atomic_load_n(&memstats[i].bytes, __ATOMIC_RELAXED),
+      __atomic_load_n(&memstats[i].freed, __ATOMIC_RELAXED),
+    };
+
+    output_printf(out, "%-14s %12lu %14lu %14lu\n", memstat_names[i],
+                  (unsigned long)stat.allocations,
+                  (unsigned long)stat.bytes,
+                  (unsigned long)(stat.bytes - stat.freed));
+  }
+
+  output_printf(out, "reader arena: %lu bytes held\n", (unsigned long)arena_held(&ctx->reader_arena));
+  output_printf(out, "permanent arena: %lu bytes held\n", (unsigned long)arena_held(&ctx->permanent_arena));
+
+  size_t chunks = 0, used = 0, spare = 0;
+
+  // the code is written into the chunks in order, and the last one's in use
+  for (size_t i = 0; i < vector_length(&ctx->code_chunks) / sizeof(struct code_chunk); ++i) {
+    const struct code_chunk* const chunk = &VECTOR_AT(&ctx->code_chunks, struct code_chunk, i);
+
+    chunks += chunk->end - chunk->start;
+    used += chunk->start == ctx->code_chunk ? ctx->program - chunk->start : chunk->end - chunk->start;
+  }
+
+  pthread_mutex_lock(&code_heap.lock);
+
+  for (size_t i = 0; i < vector_length(&code_heap.spare) / sizeof(struct code_chunk); ++i) {
+    const struct code_chunk* const chunk = &VECTOR_AT(&code_heap.spare, struct code_chunk, i);
+    spare += chunk->end - chunk->start;
+  }
+
+  pthread_mutex_unlock(&code_heap.lock);
+
+  const unsigned char* const committed = __atomic_load_n(&code_heap.committed, __ATOMIC_RELAXED);
+
+  output_printf(out,
+                "code heap: %lu bytes used of %lu in this context's chunks, %lu of %lu committed, %lu spare\n",
+                (unsigned long)used,
+                (unsigned long)chunks,
+                (unsigned long)(committed ? committed - code_heap.base : 0),
+                (unsigned long)code_heap.size,
+                (unsigned long)spare);
+
+  if (stack) {
+    output_printf(out, "data stack: %lu bytes deep, ", (unsigned long)((char*)ctx->stack_top - (char*)stack));
+  } else {
+    output_printf(out, "data stack: ");
+  }
+
+  output_printf(out, "at most %lu of %lu\n",
+                (unsigned long)stack_high_water(),
+                (unsigned long)((char*)ctx->stack_top - (char*)ctx->stack_base));
+}
+
+static GUESTFUNC(memstats_report, stack) {
+  /* memstats: -> */
+
+  memstats_print(ctx->output, stack);
+
+  return stack;
+}
+
+static void memstats_exit(void) {
+  /* Runs at exit with --memstats, before the outputs are flushed */
+
+  if (ctx) {
+    memstats_print(output_new(STDERR_FILENO), NULL);
+  }
+}
+
+/** Lazy definitions **/
+
+/* With --lazy, DEFUN doesn't compile its body straight away. It records the
+ * body's tokens, already resolved against the symbol table so that binding
+ * works exactly as if the body had been compiled eagerly, and defines the
+ * function as a stub that compiles the body the first time it runs. The stub
+ * then back-patches the call that got it there and turns itself into a jump
+ * to the real body, so the stub costs nothing after the first call.
+ *
+ * Bodies that use macros are compiled eagerly, since macros can do anything to
+ * the compiler and the input at the point they appear. */
+
+struct lazy_token {
+  struct symtab* binding; // NULL for a constant
+  long value;
+};
+
+struct lazy_defun {
+  struct slist list;
+  struct symtab* entry;
+  unsigned char* stub;
+  struct vector tokens; // of struct lazy_token
+  struct profile_counter* counter;
+};
+
+static int lazy_enabled = 0;
+
+static __thread int compile_depth; // how many definitions are being compiled right now
+
+static void* compile_definition_start(struct profile_counter* const counter) {
+  /* Returns the address of the new definition. counter is where to count
+   * calls to it, or NULL. */
+
+  code_align();
+  code_reserve(CODE_HEAP_SLACK);
+
+  void* const start = ctx->program;
+
+  if (counter) {
+    ctx->program = asm_profile_prologue(ctx->program, &counter->calls);
+  } else {
+    ctx->program = asm_prologue(ctx->program);
+  }
+
+  return start;
+}
+
+static void compile_definition_end(struct profile_counter* const counter) {
+  /* counter must be what was given to compile_definition_start */
+
+  struct symtab* const tail_callee = compile_take_tail_call();
+
+  compile_flush();
+
+  code_reserve(CODE_HEAP_SLACK);
+
+  // a veneer can't go between the epilogue and the jump
+  const void* const tail_target = tail_callee ? code_reach(tail_callee->symbol_value) : NULL;
+
+  if (counter) {
+    ctx->program = asm_profile_epilogue(ctx->program, &counter->cycles, tail_callee != NULL);
+  } else {
+    ctx->program = asm_epilogue(ctx->program, tail_callee != NULL);
+  }
+
+  if (tail_callee) {
+    // the callee returns straight to our caller
+    unsigned char* const jump = ctx->program;
+
+    record_call_site(tail_callee, jump, tail_target);
+    ctx->program = asm_jmp(jump, tail_target);
+  } else {
+    ctx->program = asm_ret(ctx->program);
+  }
+}
+
+static void lazy_compile_tokens(const struct vector* const tokens) {
+  const size_t count = vector_length(tokens) / sizeof(struct lazy_token);
+
+  for (size_t i = 0; i < count; ++i) {
+    const struct lazy_token* const token = &((const struct lazy_token*)tokens->data)[i];
+
+    if (token->binding) {
+      compile_binding(token->binding);
+    } else {
+      compile_const(token->value);
+    }
+  }
+}
+
+static void lazy_compile(struct lazy_defun* const lazy) {
+  /* Compiles the body if that hasn't happened yet */
+
+  if (lazy->entry->symbol_value == lazy->stub) {
+    unsigned char* jump_over = NULL;
+
+    if (compile_depth > 0) {
+      // a macro is running in the middle of compiling something else, so
+      // don't let the body end up in the way of the code being compiled
+      code_reserve(CODE_HEAP_SLACK);
+      ctx->program = jump_over = asm_jump(ctx->program);
+    }
+
+    void* const body = compile_definition_start(lazy->counter);
+    lazy->entry->symbol_value = body;
+    definitions_changed();
+
+    const int outer_immediate = compile_immediate;
+
+    lazy_compile_tokens(&lazy->tokens);
+    compile_definition_end(lazy->counter);
+
+    perf_note_code(lazy->entry->symbol_name, body, ctx->program);
+
+    compile_immediate = outer_immediate;
+
+    vector_delete(&lazy->tokens);
+
+    if (jump_over) {
+      if (!asm_patch_jump(jump_over, ctx->program)) {
+        error("Branch out of range in the code heap");
+      }
+    }
+
+    code_note_absolute(lazy->stub, asm_jmp(lazy->stub, body), (uintptr_t)body);
+  }
+}
+
+static void lazy_compile_all(void) {
+  for (struct lazy_defun* lazy = ctx->lazy_definitions; lazy; lazy = lazy->list.next) {
+    lazy_compile(lazy);
+  }
+}
+
+static void* lazy_resolve(struct lazy_defun* const lazy, unsigned char* const return_address) {
+  /* Called from the stub; see asm_resolver_stub */
+
+  lazy_compile(lazy);
+
+  void* const body = lazy->entry->symbol_value;
+
+  code_heap_protect(1);
+
+  if (return_address - 12 >= code_heap.base && return_address <= code_heap.committed) {
+    void* const call = asm_find_call(return_address, lazy->stub);
+
+    if (call) {
+      asm_patch_call(call, body);
+    }
+  }
+
+  code_heap_executable();
+
+  return body;
+}
+
+static struct symtab* define_lazily(void** stack,
+                                    const union rd_any* const defname,
+                                    struct profile_counter* const counter)
+{
+  /* Reads the body of a DEFUN and defines it lazily if we can, returning
+   * NULL. If we can't, compiles the tokens read so far and returns the new
+   * symbol for define_thing to carry on from there. */
+
+  struct lazy_defun* const lazy = calloc(sizeof(*lazy), 1);
+  vector_new(&lazy->tokens);
+  lazy->counter = counter;
+
+  // the name is bound to the stub while the body is read so that the body
+  // can refer to itself
+  const void* const resolver = code_reach(lazy_resolve);
+
+  code_align();
+  code_reserve(CODE_HEAP_SLACK);
+
+  lazy->stub = ctx->program;
+  ctx->program = asm_resolver_stub(ctx->program, lazy, resolver);
+
+  ADD_SYM(defname->sym.repr, lazy->stub, symtype_function);
+  lazy->entry = ctx->symbol_table;
+
+  if (perf_map || jitdump) {
+    char name[256];
+    snprintf(name, sizeof(name), "%s (lazy stub)", defname->sym.repr);
+    perf_note_code(name, lazy->stub, ctx->program);
+  }
+
+  while (1) {
+    const struct arena_mark mark = arena_mark(&ctx->reader_arena);
+
+    stack_push(&stack, &ctx->input);
+
+    call_guest_function(read_form, &stack);
+
+    union rd_any* const obj = stack_pop(&stack);
+
+    if (!obj) {
+      error("EOF in definition of '%s'", defname->sym.repr);
+    }
+
+    if (obj->base.type == rd_type_symbol && &obj->sym == ctx->atom_done) {
+      break;
+    }
+
+    struct lazy_token token = { NULL, 0 };
+    int eager = 0;
+
+    switch (obj->base.type) {
+    case rd_type_symbol:
+      token.binding = atom_binding(&obj->sym, ctx->symbol_table);
+
+      if (!token.binding) {
+        error("The name '%s' is undefined", obj->sym.repr);
+      }
+
+      lazy->entry->immediate |= token.binding->immediate;
+      eager = token.binding->symbol_type == symtype_macro;
+      break;
+    case rd_type_number:
+      token.value = obj->num.value;
+      break;
+    case rd_type_string:
+      token.value = (intptr_t)promote_string(obj->str.contents);
+      break;
+    case rd_type_quote:
+      // the forms in a quotation don't fit in a token
+      eager = 1;
+      break;
+    case rd_type_cons:
+      error("unimplemented");
+    }
+
+    if (eager) {
+      /* Too late for laziness. Compile what we have and let define_thing
+       * compile the rest, starting with this form. The stub just
+       * forwards to the real definition from now on. */
+
+      void* const body = compile_definition_start(counter);
+      ADD_SYM(defname->sym.repr, body, symtype_function);
+      code_note_absolute(lazy->stub, asm_jmp(lazy->stub, body), (uintptr_t)body);
+
+      struct symtab* const entry = ctx->symbol_table;
+
+      lazy_compile_tokens(&lazy->tokens);
+
+      vector_delete(&lazy->tokens);
+      free(lazy);
+
+      stack_push(&stack, obj);
+      call_guest_function(compile, &stack);
+
+      arena_release(&ctx->reader_arena, mark);
+
+      return entry;
+    }
+
+    VECTOR_APPEND(&lazy->tokens, struct lazy_token, token);
+
+    arena_release(&ctx->reader_arena, mark);
+  }
+
+  slist_push(&ctx->lazy_definitions->list, &lazy->list);
+  ctx->lazy_definitions = lazy;
+
+  return NULL;
+}
+
+static void define_thing(void** stack, const enum symbol_type thing_type) {
+  stack_push(&stack, &ctx->input);
+
+  call_guest_function(read_form, &stack);
+
+  const union rd_any* const defname = stack_pop(&stack);
+
+  if (defname->base.type != rd_type_symbol) {
+    error("Definition name must be a symbol");
+  }
+
+  ++compile_depth;
+
+  const int outer_immediate = compile_immediate;
+  compile_immediate = 0;
+
+  struct symtab* entry = NULL;
+  struct profile_counter* const counter = (thing_type != symtype_value
+                                           ? profile_counter_new(defname->sym.repr)
+                                           : NULL);
+
+  if (thing_type == symtype_function && lazy_enabled) {
+    entry = define_lazily(stack, defname, counter);
+
+    if (!entry) {
+      --compile_depth;
+      compile_immediate = outer_immediate;
+      return;
+    }
+  } else if (thing_type != symtype_value) {
+    ADD_SYM(defname->sym.repr, compile_definition_start(counter), thing_type);
+    entry = ctx->symbol_table;
+  }
+
+  while (1) {
+    const struct arena_mark mark = arena_mark(&ctx->reader_arena);
+
+    stack_push(&stack, &ctx->input);
+
+    call_guest_function(read_form, &stack);
+
+    union rd_any* const obj = stack_pop(&stack);
+
+    if (!obj) {
+      error("EOF in definition of '%s'", defname->sym.repr);
+    }
+
+    if (obj->base.type == rd_type_symbol && &obj->sym == ctx->atom_done) {
+      break;
+    }
+
+    stack_push(&stack, obj);
+
+    if (thing_type == symtype_value) {
+      call_guest_function(eval, &stack);
+    } else {
+      call_guest_function(compile, &stack);
+    }
+
+    arena_release(&ctx->reader_arena, mark);
+  }
+
+  --compile_depth;
+
+  if (thing_type == symtype_value) {
+    compile_immediate = outer_immediate;
+
+    void* const val = stack_pop(&stack);
+    ADD_SYM(defname->sym.repr, val, symtype_value);
+    return;
+  }
+
+  compile_definition_end(counter);
+
+  perf_note_code(entry->symbol_name, entry->symbol_value, ctx->program);
+
+  entry->immediate = compile_immediate;
+  compile_immediate = outer_immediate;
+}
+
+static GUESTFUNC(defun, stack) {
+  define_thing(stack, symtype_function);
+
+  return stack;
+}
+
+static GUESTFUNC(defmacro, stack) {
+  define_thing(stack, symtype_macro);
+
+  return stack;
+}
+
+static GUESTFUNC(defval, stack) {
+  define_thing(stack, symtype_value);
+
+  return stack;
+}
+
+/** Batch mode **/
+
+/* With --batch, runs of top-level forms are compiled into a thunk that runs
+ * once, instead of going through eval one form at a time. Anything immediate
+ * has to see the effects of the forms before it and can affect how the forms
+ * after it are read and bound, so it runs the thunk so far and then gets
+ * evaluated on its own. Immediate things are macros, the intrinsics that read
+ * input, define things or write memory, and functions that call any of those.
+ *
+ * Reader macros still run when their form is read, which can be before the
+ * earlier forms in the same thunk have run. */
+
+#define BATCH_MAX_FORMS 1024 // so output doesn't lag too far behind input
+
+static int batch_enabled = 0;
+
+static __thread struct {
+  unsigned char* start; // NULL when there's no thunk
+  size_t forms;
+} batch;
+
+static void batch_flush(void*** const stack) {
+  /* Runs the thunk, if there is one */
+
+  if (!batch.start) {
+    return;
+  }
+
+  unsigned char* const start = batch.start;
+  batch.start = NULL;
+
+  compile_definition_end(NULL);
+  record_call_sites = 1;
+
+  unsigned char* const end = ctx->program;
+
+  code_heap_executable();
+  call_guest_function(start, stack);
+
+  // nothing can refer to the thunk now, so its code can be reused unless
+  // something was compiled after it while it ran, or it ran into a new chunk
+  if (ctx->program == end && start >= ctx->code_chunk) {
+    ctx->program = start;
+    code_forget_absolutes(start);
+  }
+}
+
+static void batch_form(void*** const stack, union rd_any* const rdobj) {
+  /* Adds rdobj to the thunk, or evaluates it if it can't wait */
+
+  struct symtab* binding = NULL;
+
+  if (rdobj->base.type == rd_type_symbol) {
+    binding = atom_binding(&rdobj->sym, ctx->symbol_table);
+
+    if (!binding || binding->immediate || binding->symbol_type == symtype_macro) {
+      // undefined names go to eval too, which complains about them in the
+      // right place in the output
+      batch_flush(stack);
+
+      stack_push(stack, rdobj);
+      call_guest_function(eval, stack);
+      return;
+    }
+  } else if (rdobj->base.type != rd_type_number && rdobj->base.type != rd_type_string) {
+    batch_flush(stack);
+
+    stack_push(stack, rdobj);
+    call_guest_function(eval, stack);
+    return;
+  }
+
+  if (!batch.start) {
+    batch.start = compile_definition_start(NULL);
+    batch.forms = 0;
+    record_call_sites = 0;
+  }
+
+  if (binding) {
+    compile_binding(binding);
+  } else if (rdobj->base.type == rd_type_number) {
+    compile_const(rdobj->num.value);
+  } else {
+    compile_const((intptr_t)promote_string(rdobj->str.contents));
+  }
+
+  if (++batch.forms == BATCH_MAX_FORMS) {
+    batch_flush(stack);
+  }
+}
+
+/** Images **/
+
+/* An image is a snapshot of the code heap, the symbol table, the string
+ * literals and the readtable that can be loaded instead of starting from
+ * scratch. The code is page aligned in the file and mmapped straight into the
+ * code heap, so pages that don't need relocating stay shared with the file.
+ *
+ * The code heap is mapped at the same distance from the kernel's text as when
+ * the image was saved, so rel32 calls between the two never need fixing up,
+ * and any address in the kernel or the code heap moves by the same amount.
+ * Other 64-bit values, in the code or in symbols, are classified when the
+ * image is saved: addresses of string literals and symbol table entries are
+ * translated, anything else is taken to be a plain number. In particular,
+ * memory from ALLOC doesn't survive.
+ *
+ * An image only makes sense with the kernel that saved it, which is checked
+ * with a hash of the kernel's text. Pending lazy definitions are compiled
+ * before saving. */
+
+#define IMAGE_MAGIC "SIMPLIMG"
+
+enum image_value_kind {
+  image_plain,
+  image_relative, // an address in the kernel or the code heap, from __executable_start
+  image_string, // offset into the string literals
+  image_symbol, // index into the symbols
+};
+
+struct image_value {
+  uint64_t kind;
+  uint64_t value;
+};
+
+struct image_header {
+  char magic[8];
+  uint64_t fingerprint;
+  int64_t heap_offset; // of the code heap from __executable_start
+  uint64_t heap_size;
+  uint64_t code_offset, code_size; // in the file
+  uint64_t rest_offset; // everything else follows the code
+};
+
+/* After the code: the string literals, the symbols oldest first, the code
+ * relocations and the readtable */
+
+struct image_strings {
+  uint64_t size;
+  // followed by the strings
+};
+
+struct image_symbol {
+  uint64_t type;
+  uint64_t immediate;
+  struct image_value value;
+  int64_t redefinition; // symbol index or -1
+  uint64_t name_length;
+  uint64_t site_count;
+  // followed by the name and then the call sites as uint64_t code offsets
+};
+
+struct image_reloc {
+  uint64_t offset; // into the code
+  struct image_value value;
+};
+
+struct image_readtable {
+  char_prop_t char_properties[256];
+  struct image_value macro_dispatch[256];
+};
+
+struct image_chunk {
+  const char* data;
+  size_t size;
+};
+
+static struct {
+  // while saving
+  struct vector chunks; // of struct image_chunk, the permanent arena oldest first
+  struct symtab** symbols; // oldest first
+  size_t symbol_count;
+
+  // while loading
+  char* strings;
+  struct symtab** loaded;
+  size_t loaded_count;
+} image;
+
+static uint64_t image_fingerprint(void) {
+  /* FNV-1a of the kernel's text */
+
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  for (const unsigned char* p = (const unsigned char*)__executable_start; p < (const unsigned char*)etext; ++p) {
+    hash = (hash ^ *p) * 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+static size_t image_page_size(void) {
+  return sysconf(_SC_PAGESIZE);
+}
+
+static size_t image_round_up(const size_t size) {
+  return (size + image_page_size() - 1) & ~(image_page_size() - 1);
+}
+
+static struct image_value image_classify(const uint64_t value) {
+  struct image_value v = { image_plain, value };
+
+  if ((value >= (uintptr_t)__executable_start && value < (uintptr_t)_end)
+      || (value >= (uintptr_t)code_heap.base && value < (uintptr_t)code_heap.limit))
+  {
+    v.kind = image_relative;
+    v.value = value - (uintptr_t)__executable_start;
+    return v;
+  }
+
+  size_t offset = 0;
+
+  for (size_t i = 0; i < vector_length(&image.chunks) / sizeof(struct image_chunk); ++i) {
+    const struct image_chunk* const chunk = &VECTOR_AT(&image.chunks, struct image_chunk, i);
+
+    if (value >= (uintptr_t)chunk->data && value < (uintptr_t)chunk->data + chunk->size) {
+      v.kind = image_string;
+      v.value = offset + (value - (uintptr_t)chunk->data);
+      return v;
+    }
+
+    offset += chunk->size;
+  }
+
+  for (size_t i = 0; i < image.symbol_count; ++i) {
+    if (value == (uintptr_t)image.symbols[i]) {
+      v.kind = image_symbol;
+      v.value = i;
+      return v;
+    }
+  }
+
+  return v;
+}
+
+static uint64_t image_resolve(const struct image_value v) {
+  switch (v.kind) {
+  case image_plain:
+    return v.value;
+  case image_relative:
+    return (uintptr_t)__executable_start + v.value;
+  case image_string:
+    return (uintptr_t)image.strings + v.value;
+  case image_symbol:
+    if (v.value < image.loaded_count) {
+      return (uintptr_t)image.loaded[v.value];
+    }
+    break;
+  }
+
+  error("Corrupt image");
+  return 0;
+}
+
+static void image_write(FILE* const file, const void* const data, const size_t size) {
+  if (size && fwrite(data, size, 1, file) != 1) {
+    error("Failed to write image: %s", strerror(errno));
+  }
+}
+
+static void image_pad(FILE* const file, const long to, const int fill) {
+  while (ftell(file) < to) {
+    if (fputc(fill, file) == EOF) {
+      error("Failed to write image: %s", strerror(errno));
+    }
+  }
+}
+
+static void image_save(const char* const path) {
+  if (compile_depth > 0 || ir_length() > 0) {
+    error("Can't save an image in the middle of a definition");
+  }
+
+  if (profile_enabled) {
+    error("Can't save an image of profiled code");
+  }
+
+  if (vector_length(&ctx->code_chunks) > sizeof(struct code_chunk)
+      || (ctx->code_chunk && ctx->code_chunk != code_heap.base))
+  {
+    error("Can't save an image of code that isn't in one piece at the start of the code heap");
+  }
+
+  for (const struct symtab* tab = ctx->symbol_table; tab; tab = tab->list.next) {
+    if (tab->owner != ctx) {
+      error("Can't save an image of a context that shares another's definitions");
+    }
+  }
+
+  lazy_compile_all();
+
+  /* Gather the strings and symbols */
+
+  vector_new(&image.chunks);
+
+  for (struct arena_chunk* chunk = ctx->permanent_arena.chunk; chunk; chunk = chunk->prev) {
+    const char* const end = chunk == ctx->permanent_arena.chunk ? ctx->permanent_arena.ptr : chunk->end;
+    const struct image_chunk c = { chunk->data, end - chunk->data };
+
+    VECTOR_APPEND(&image.chunks, struct image_chunk, c);
+  }
+
+  // chunks were gathered newest first
+  const size_t chunk_count = vector_length(&image.chunks) / sizeof(struct image_chunk);
+
+  for (size_t i = 0; i < chunk_count / 2; ++i) {
+    const struct image_chunk c = VECTOR_AT(&image.chunks, struct image_chunk, i);
+    VECTOR_AT(&image.chunks, struct image_chunk, i) = VECTOR_AT(&image.chunks, struct image_chunk, chunk_count - 1 - i);
+    VECTOR_AT(&image.chunks, struct image_chunk, chunk_count - 1 - i) = c;
+  }
+
+  image.symbol_count = 0;
+
+  for (struct symtab* tab = ctx->symbol_table; tab; tab = tab->list.next) {
+    ++image.symbol_count;
+  }
+
+  image.symbols = calloc(sizeof(*image.symbols), image.symbol_count + 1);
+
+  {
+    size_t i = image.symbol_count;
+
+    for (struct symtab* tab = ctx->symbol_table; tab; tab = tab->list.next) {
+      image.symbols[--i] = tab;
+    }
+  }
+
+  /* Write it all out */
+
+  FILE* const file = fopen(path, "wb");
+
+  if (!file) {
+    error("Could not open '%s' to save an image: %s", path, strerror(errno));
+  }
+
+  const size_t code_size = ctx->code_chunk ? ctx->program - code_heap.base : 0;
+
+  struct image_header header = {
+    .fingerprint = image_fingerprint(),
+    .heap_offset = (intptr_t)code_heap.base - (intptr_t)__executable_start,
+    .heap_size = code_heap.size,
+    .code_offset = image_round_up(sizeof(header)),
+    .code_size = code_size,
+  };
+
+  memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+  header.rest_offset = header.code_offset + image_round_up(code_size);
+
+  image_write(file, &header, sizeof(header));
+  image_pad(file, header.code_offset, 0);
+  image_write(file, code_heap.base, code_size);
+  image_pad(file, header.rest_offset, 0xcc);
+
+  struct image_strings strings = { 0 };
+
+  for (size_t i = 0; i < chunk_count; ++i) {
+    strings.size += VECTOR_AT(&image.chunks, struct image_chunk, i).size;
+  }
+
+  image_write(file, &strings, sizeof(strings));
+
+  for (size_t i = 0; i < chunk_count; ++i) {
+    const struct image_chunk* const chunk = &VECTOR_AT(&image.chunks, struct image_chunk, i);
+    image_write(file, chunk->data, chunk->size);
+  }
+
+  const uint64_t symbol_count = image.symbol_count;
+  image_write(file, &symbol_count, sizeof(symbol_count));
+
+  for (size_t i = 0; i < image.symbol_count; ++i) {
+    const struct symtab* const tab = image.symbols[i];
+
+    struct image_symbol sym = {
+      .type = tab->symbol_type,
+      .immediate = tab->immediate,
+      .value = image_classify((uintptr_t)tab->symbol_value),
+      .redefinition = -1,
+      .name_length = strlen(tab->symbol_name),
+    };
+
+    if (tab->redefinition) {
+      const struct image_value redef = image_classify((uintptr_t)tab->redefinition);
+
+      if (redef.kind == image_symbol) {
+        sym.redefinition = redef.value;
+      }
+    }
+
+    for (const struct call_site* site = tab->call_sites; site; site = site->list.next) {
+      if ((unsigned char*)site->call < ctx->program) {
+        ++sym.site_count;
+      }
+    }
+
+    image_write(file, &sym, sizeof(sym));
+    image_write(file, tab->symbol_name, sym.name_length);
+
+    for (const struct call_site* site = tab->call_sites; site; site = site->list.next) {
+      if ((unsigned char*)site->call < ctx->program) {
+        const uint64_t offset = (unsigned char*)site->call - code_heap.base;
+        image_write(file, &offset, sizeof(offset));
+      }
+    }
+  }
+
+  struct vector relocs;
+  vector_new(&relocs);
+
+  for (size_t i = 0; i < vector_length(&ctx->code_absolutes) / sizeof(size_t); ++i) {
+    const size_t offset = VECTOR_AT(&ctx->code_absolutes, size_t, i);
+
+    if (offset + sizeof(uint64_t) > code_size) {
+      continue;
+    }
+
+    const struct image_reloc reloc = {
+      offset,
+      image_classify(*(const uint64_t*)(code_heap.base + offset)),
+    };
+
+    if (reloc.value.kind != image_plain) {
+      VECTOR_APPEND(&relocs, struct image_reloc, reloc);
+    }
+  }
+
+  const uint64_t reloc_count = vector_length(&relocs) / sizeof(struct image_reloc);
+  image_write(file, &reloc_count, sizeof(reloc_count));
+  image_write(file, vector_data(&relocs), vector_length(&relocs));
+
+  struct image_readtable readtable;
+  memcpy(readtable.char_properties, ctx->readtable->char_properties, sizeof(readtable.char_properties));
+
+  for (int i = 0; i < 256; ++i) {
+    readtable.macro_dispatch[i] = image_classify((uintptr_t)ctx->readtable->macro_dispatch[i]);
+  }
+
+  image_write(file, &readtable, sizeof(readtable));
+
+  if (fclose(file) != 0) {
+    error("Failed to write image: %s", strerror(errno));
+  }
+
+  vector_delete(&relocs);
+  vector_delete(&image.chunks);
+  free(image.symbols);
+  image.symbols = NULL;
+  image.symbol_count = 0;
+}
+
+static const void* image_take(const unsigned char** const cursor, const unsigned char* const end, const size_t size) {
+  /* Reads size bytes of the image at *cursor */
+
+  if ((size_t)(end - *cursor) < size) {
+    error("Truncated image");
+  }
+
+  const void* const data = *cursor;
+  *cursor += size;
+
+  return data;
+}
+
+static void image_load(const char* const path) {
+  /* Sets up the code heap, symbol table and readtable from an image instead
+   * of from scratch */
+
+  const int fd = open(path, O_RDONLY);
+
+  if (fd < 0) {
+    error("Could not open image '%s': %s", path, strerror(errno));
+  }
+
+  struct stat st;
+
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct image_header)) {
+    error("'%s' isn't an image", path);
+  }
+
+  const unsigned char* const file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (file == MAP_FAILED) {
+    error("Failed to map image '%s': %s", path, strerror(errno));
+  }
+
+  const unsigned char* const file_end = file + st.st_size;
+  const struct image_header* const header = (const struct image_header*)file;
+
+  if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0) {
+    error("'%s' isn't an image", path);
+  }
+
+  if (header->fingerprint != image_fingerprint()) {
+    error("Image '%s' was saved by a different build", path);
+  }
+
+  if (header->code_size > header->heap_size
+      || header->code_offset + header->code_size > (uint64_t)st.st_size
+      || header->rest_offset > (uint64_t)st.st_size)
+  {
+    error("Truncated image");
+  }
+
+  /* The code goes exactly as far from the text as it was */
+
+  void* const hint = __executable_start + header->heap_offset;
+  void* const heap = mmap(hint, header->heap_size, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+
+  if (heap != hint) {
+    error("Can't map the code heap where image '%s' needs it", path);
+  }
+
+  code_heap.base = heap;
+  code_heap.size = header->heap_size;
+  code_heap.limit = code_heap.base + code_heap.size;
+  code_heap.committed = code_heap.base;
+
+  if (header->code_size) {
+    const size_t mapped = image_round_up(header->code_size);
+
+    if (mmap(heap, mapped, code_heap_prot(1), MAP_PRIVATE | MAP_FIXED, fd, header->code_offset) == MAP_FAILED) {
+      error("Failed to map image '%s': %s", path, strerror(errno));
+    }
+
+    code_heap.committed = code_heap.base + mapped;
+    code_add_chunk(code_heap.base, mapped);
+
+    ctx->program = code_heap.base + header->code_size;
+
+    // the code can run into the room kept for a jump out of the chunk, but
+    // the next chunk follows straight on
+    if (ctx->program > ctx->code_limit) {
+      code_commit();
+    }
+  }
+
+  close(fd);
+
+  /* Everything else */
+
+  const unsigned char* cursor = file + header->rest_offset;
+
+  const struct image_strings* const strings = image_take(&cursor, file_end, sizeof(*strings));
+
+  if (strings->size) {
+    image.strings = arena_alloc(&ctx->permanent_arena, strings->size);
+    memcpy(image.strings, image_take(&cursor, file_end, strings->size), strings->size);
+  }
+
+  const uint64_t symbol_count = *(const uint64_t*)image_take(&cursor, file_end, sizeof(uint64_t));
+  const struct image_symbol** const symbols = calloc(sizeof(*symbols), symbol_count + 1);
+
+  image.loaded = calloc(sizeof(*image.loaded), symbol_count + 1);
+  image.loaded_count = symbol_count;
+
+  // create all the symbols first since their values can refer to each other
+  for (size_t i = 0; i < symbol_count; ++i) {
+    symbols[i] = image_take(&cursor, file_end, sizeof(**symbols));
+
+    const char* const name = image_take(&cursor, file_end, symbols[i]->name_length);
+    char* const symbol_name = strndup(name, symbols[i]->name_length);
+
+    ctx->symbol_table = symtab_add_symbol(ctx->symbol_table, symbol_name, NULL, symbols[i]->type);
+    image.loaded[i] = ctx->symbol_table;
+
+    free(symbol_name);
+
+    image_take(&cursor, file_end, symbols[i]->site_count * sizeof(uint64_t));
+  }
+
+  for (size_t i = 0; i < symbol_count; ++i) {
+    struct symtab* const tab = image.loaded[i];
+    const uint64_t* const sites = (const uint64_t*)((const char*)(symbols[i] + 1) + symbols[i]->name_length);
+
+    tab->symbol_value = (void*)image_resolve(symbols[i]->value);
+    definitions_changed();
+    tab->immediate = symbols[i]->immediate;
+
+    if (symbols[i]->redefinition >= 0 && (uint64_t)symbols[i]->redefinition < symbol_count) {
+      tab->redefinition = image.loaded[symbols[i]->redefinition];
+    }
+
+    for (size_t j = 0; j < symbols[i]->site_count; ++j) {
+      if (sites[j] >= header->code_size) {
+        error("Corrupt image");
+      }
+
+      unsigned char* const call = code_heap.base + sites[j];
+      record_call_site(tab, call, asm_call_target(call));
+    }
+  }
+
+  const uint64_t reloc_count = *(const uint64_t*)image_take(&cursor, file_end, sizeof(uint64_t));
+  const struct image_reloc* const relocs = image_take(&cursor, file_end, reloc_count * sizeof(*relocs));
+
+  for (size_t i = 0; i < reloc_count; ++i) {
+    if (relocs[i].offset + sizeof(uint64_t) > header->code_size) {
+      error("Corrupt image");
+    }
+
+    *(uint64_t*)(code_heap.base + relocs[i].offset) = image_resolve(relocs[i].value);
+    VECTOR_APPEND(&ctx->code_absolutes, size_t, relocs[i].offset);
+  }
+
+  const struct image_readtable* const readtable = image_take(&cursor, file_end, sizeof(*readtable));
+
+  memcpy(ctx->readtable->char_properties, readtable->char_properties, sizeof(readtable->char_properties));
+
+  for (int i = 0; i < 256; ++i) {
+    ctx->readtable->macro_dispatch[i] = (guest_function)image_resolve(readtable->macro_dispatch[i]);
+  }
+
+  free(symbols);
+  free(image.loaded);
+  image.loaded = NULL;
+  image.loaded_count = 0;
+
+  munmap((void*)file, st.st_size);
+}
+
+static GUESTFUNC(save_image, stack) {
+  const char* const path = stack_pop(&stack);
+
+  image_save(path);
+
+  return stack;
+}
+
+/* The default readtable, which is immutable */
+
+static const struct readtable default_readtable = {
+  { // char_properties
+    ['a' ... 'z'] = cprop_constituent,
+    ['A' ... 'Z'] = cprop_constituent,
+    ['_']         = cprop_constituent,
+    ['!']         = cprop_constituent,
+    ['@']         = cprop_constituent,
+    ['#']         = cprop_constituent,
+    ['$']         = cprop_constituent,
+    ['%']         = cprop_constituent,
+    ['^']         = cprop_constituent,
+    ['&']         = cprop_constituent,
+    ['*']         = cprop_constituent,
+    [':']         = cprop_constituent,
+    [',']         = cprop_constituent,
+    ['.']         = cprop_constituent,
+    ['<']         = cprop_constituent,
+    ['>']         = cprop_constituent,
+    ['=']         = cprop_constituent,
+    ['/']         = cprop_constituent,
+    ['?']         = cprop_constituent,
+    [';']         = cprop_constituent,
+
+    ['-']         = cprop_number_init | cprop_constituent,
+    ['+']         = cprop_number_init | cprop_constituent,
+    ['0' ... '9'] = cprop_number_init | cprop_number | cprop_constituent,
+
+    ['"']         = cprop_macro,
+    ['[']         = cprop_macro,
+    [']']         = cprop_error,
+    ['(']         = cprop_macro,
+    [')']         = cprop_error,
+
+    [' ']         = cprop_whitespace,
+    ['\n']        = cprop_whitespace,
+    ['\t']        = cprop_whitespace,
+    ['\r']        = cprop_whitespace,
+  },
+  
+  { // macro_dispatch
+    ['"']         = read_string,
+    ['[']         = read_quote,
+    [']']         = read_error,
+    ['(']         = read_list,
+    [')']         = read_error,
+  }
+};
+
+/* Stack guards */
+
+/* A fault in a guard region of the data stack becomes an ordinary fatal error,
+ * and so does one just below the native stack the thread is running on, since
+ * deep recursion uses that up faster than the data stack. Anything else is
+ * left to crash as it would have. The handler runs on its own stack, as the
+ * native one has no room left by then. */
+
+#define STACK_DEFAULT_SIZE (8ULL * 1024 * 1024)
+#define SIGNAL_STACK_SIZE (64 * 1024)
+
+// below every native stack, more than the biggest frame C code might skip
+// over it with
+#define NATIVE_GUARD_SIZE (64 * 1024)
+
+static size_t stack_size = STACK_DEFAULT_SIZE;
+
+// the lowest usable address of the native stack the thread is running on
+static __thread const char* native_stack_low;
+
+static void stack_fault(const int sig, siginfo_t* const info, void* const context) {
+  const char* const addr = info->si_addr;
+
+  /* error isn't async-signal-safe, but guest stack accesses never happen
+   * inside stdio or malloc, and flushing the output matters more */
+
+  if (native_stack_low && addr < native_stack_low && addr >= native_stack_low - NATIVE_GUARD_SIZE) {
+    error("Native stack overflow; the recursion is too deep");
+  }
+
+  if (ctx) {
+    const char* const base = (const char*)ctx->stack_base;
+    const char* const top = (const char*)ctx->stack_top;
+
+    if (addr < base && addr >= base - STACK_GUARD_SIZE) {
+      error("Stack overflow; try a bigger --stack-size");
+    }
+
+    if (addr >= top && addr < top + STACK_GUARD_SIZE) {
+      error("Stack underflow");
+    }
+  }
+
+  // not ours, so fault again without the handler
+  signal(sig, SIG_DFL);
+}
+
+static void stack_guard(void) {
+  /* Installs stack_fault for the calling thread, which checks the stack of
+   * whatever context the thread is running */
+
+  static __thread int guarded = 0;
+
+  if (guarded) {
+    return;
+  }
+
+  guarded = 1;
+
+  // the main thread's stack has the kernel's guard gap below it, and other
+  // threads' come from stack_thread_create
+  pthread_attr_t attr;
+
+  if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+    void* low;
+    size_t size;
+
+    if (pthread_attr_getstack(&attr, &low, &size) == 0) {
+      native_stack_low = low;
+    }
+
+    pthread_attr_destroy(&attr);
+  }
+
+  stack_t alt = { .ss_sp = malloc(SIGNAL_STACK_SIZE), .ss_size = SIGNAL_STACK_SIZE };
+
+  if (!alt.ss_sp || sigaltstack(&alt, NULL) != 0) {
+    error("Failed to set up the signal stack: %s", strerror(errno));
+  }
+
+  struct sigaction action = { .sa_sigaction = stack_fault, .sa_flags = SA_SIGINFO | SA_ONSTACK };
+  sigemptyset(&action.sa_mask);
+
+  if (sigaction(SIGSEGV, &action, NULL) != 0 || sigaction(SIGBUS, &action, NULL) != 0) {
+    error("Failed to install the stack guard: %s", strerror(errno));
+  }
+}
+
+static int stack_thread_create(pthread_t* const thread, void* (*const start)(void*)) {
+  /* pthread_create with a guard of at least NATIVE_GUARD_SIZE below the new
+   * thread's stack */
+
+  pthread_attr_t attr;
+  size_t guard = 0;
+
+  int err = pthread_attr_init(&attr);
+
+  if (err == 0) {
+    pthread_attr_getguardsize(&attr, &guard);
+
+    if (guard < NATIVE_GUARD_SIZE) {
+      err = pthread_attr_setguardsize(&attr, NATIVE_GUARD_SIZE);
+    }
+
+    if (err == 0) {
+      err = pthread_create(thread, &attr, start, NULL);
+    }
+
+    pthread_attr_destroy(&attr);
+  }
+
+  return err;
+}
+
+/* Making contexts */
+
+static void context_init(struct context* const c,
+                         struct readtable* const readtable,
+                         const struct context* const base)
+{
+  /* Sets c up to run a script, with readtable as its readtable. c starts out
+   * with base's definitions and a copy of its readtable, or with nothing but
+   * the default readtable if base is NULL. base mustn't change once it's
+   * shared, so its lazy definitions should be compiled first. */
+
+  const struct context fresh = {
+    .symbol_table = base ? base->symbol_table : SYMTAB_EMPTY,
+    .readtable = readtable,
+    .output = base ? NULL : output_new(STDOUT_FILENO),
+    .code_writable = 1,
+    .atoms = calloc(sizeof(struct atom_table), 1),
+  };
+
+  if (!fresh.atoms) {
+    error("Failed to allocate a context");
+  }
+
+  fresh.atoms->epoch = 1;
+
+  *c = fresh;
+  *readtable = base ? *base->readtable : default_readtable;
+
+  stack_new(&c->stack_base, &c->stack_top, stack_size);
+}
+
+static void context_enter(struct context* const c) {
+  /* Makes c the calling thread's context */
+
+  ctx = c;
+
+  if (!ctx->atom_done) {
+    ctx->atom_done = intern("DONE", 4);
+  }
+
+  stack_guard();
+}
+
+static struct context* context_new(const struct context* const base) {
+  /* Makes a context for another thread; see context_init */
+
+  struct context* const c = malloc(sizeof(*c));
+  struct readtable* const readtable = malloc(sizeof(*readtable));
+
+  if (!c || !readtable) {
+    error("Failed to allocate a context");
+  }
+
+  context_init(c, readtable, base);
+
+  return c;
+}
+
+static void context_reset(const struct context* const base) {
+  /* Throws away everything ctx has defined and compiled since it was made on
+   * top of base, so that it can run another script. Its code chunks go back
+   * to the code heap as spares. */
+
+  while (ctx->symbol_table && ctx->symbol_table->owner == ctx) {
+    struct symtab* const tab = ctx->symbol_table;
+    ctx->symbol_table = tab->list.next;
+
+    struct call_site* site = tab->call_sites;
+
+    while (site) {
+      struct call_site* const next = site->list.next;
+      memstat_forget(memstat_call_site, sizeof(*site));
+      free(site);
+      site = next;
+    }
+
+    memstat_forget(memstat_symbol, sizeof(*tab) + strlen(tab->symbol_name) + 1);
+    free(tab->symbol_name);
+    free(tab);
+  }
+
+  ctx->symbol_table = base->symbol_table;
+  atoms_rebind(ctx->symbol_table);
+
+  *ctx->readtable = *base->readtable;
+
+  const struct arena_mark empty = { NULL, NULL };
+  arena_release(&ctx->reader_arena, empty);
+  arena_release(&ctx->permanent_arena, empty);
+
+  code_release();
+
+  // so that stack_high_water only sees how deep the next script goes
+  madvise(ctx->stack_base, (char*)ctx->stack_top - (char*)ctx->stack_base, MADV_DONTNEED);
+
+  ctx->code_absolutes.fill = 0;
+  ctx->code_veneers.fill = 0;
+
+  while (ctx->lazy_definitions) {
+    struct lazy_defun* const lazy = ctx->lazy_definitions;
+    ctx->lazy_definitions = lazy->list.next;
+
+    vector_delete(&lazy->tokens);
+    free(lazy);
+  }
+}
+
+/* Running files */
+
+static void compiler_reset(void) {
+  /* Forgets whatever the compiler was in the middle of when an error cut it
+   * short */
+
+  ir_buffer.fill = 0;
+  ir_blocks.fill = 0;
+  ir_floor = 0;
+  regcache.depth = 0;
+  compile_depth = 0;
+  compile_immediate = 0;
+  compile_quote_depth = 0;
+  record_call_sites = 1;
+  batch.start = NULL;
+}
+
+static int run_form(void*** const stack) {
+  /* Reads and runs the next form from *IN*. Returns zero at end of input. */
+
+  const struct arena_mark mark = arena_mark(&ctx->reader_arena);
+
+  stack_push(stack, &ctx->input);
+
+  call_guest_function(read_form, stack);
+
+  struct rd_object* const obj = stack_pop(stack);
+
+  if (!obj) {
+    return 0;
+  }
+
+  if (batch_enabled) {
+    batch_form(stack, (union rd_any*)obj);
+  } else {
+    stack_push(stack, obj);
+
+    call_guest_function(eval, stack);
+  }
+
+  arena_release(&ctx->reader_arena, mark);
+
+  return 1;
+}
+
+static void run_file(const char* const path, void*** const stack) {
+  /* Reads and runs the forms in path one at a time */
+
+  ctx->input = input_open(path);
+
+  if (!ctx->input) {
+    error("Could not open file '%s'", path);
+  }
+
+  while (run_form(stack)) {
+  }
+
+  batch_flush(stack);
+
+  input_close(ctx->input);
+  ctx->input = NULL;
+}
+
+/** Worker pool **/
+
+/* With -j N, the first file is a prelude that runs as usual, and then the rest
+ * are shared out between N worker threads, each file in a context of its own
+ * on top of the prelude's. What a file prints is collected and written out in
+ * the order the files were given, and the first file to fail ends the run
+ * there, just as if they'd all run one after another. Files don't see each
+ * other's definitions or anything left on the stack, and since the prelude is
+ * shared, redefining one of its words in a file doesn't change what the
+ * prelude's own code calls (see record_call_site). */
+
+struct job {
+  const char* path;
+  char* output, * errors; // what it printed, once it's done
+  size_t output_size, errors_size;
+  int failed;
+  int done;
+};
+
+static size_t worker_count; // 0 to run everything on the main thread
+
+static struct {
+  const struct context* base;
+  struct job* jobs;
+  size_t count;
+  size_t next; // the next job to hand out
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+} pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .done = PTHREAD_COND_INITIALIZER };
+
+static void job_run(struct job* const job) {
+  struct output* const output = output_new(-1);
+  FILE* const errors = open_memstream(&job->errors, &job->errors_size);
+
+  if (!errors) {
+    error("Failed to collect the output of '%s': %s", job->path, strerror(errno));
+  }
+
+  void** stack = ctx->stack_top;
+  sigjmp_buf handler;
+
+  ctx->output = output;
+  error_output = errors;
+  error_handler = &handler;
+
+  if (sigsetjmp(handler, 1) == 0) {
+    run_file(job->path, &stack);
+  } else {
+    job->failed = 1;
+    compiler_reset();
+
+    if (ctx->input) {
+      input_close(ctx->input);
+      ctx->input = NULL;
+    }
+  }
+
+  error_handler = NULL;
+  error_output = NULL;
+  ctx->output = NULL;
+
+  output_flush(output);
+  job->output = vector_data(&output->kept);
+  job->output_size = vector_length(&output->kept);
+  free(output);
+
+  fclose(errors);
+}
+
+static void* worker_main(void* const arg) {
+  context_enter(context_new(pool.base));
+
+  while (1) {
+    const size_t i = __atomic_fetch_add(&pool.next, 1, __ATOMIC_RELAXED);
+
+    if (i >= pool.count) {
+      break;
+    }
+
+    job_run(&pool.jobs[i]);
+
+    pthread_mutex_lock(&pool.lock);
+    pool.jobs[i].done = 1;
+    pthread_cond_broadcast(&pool.done);
+    pthread_mutex_unlock(&pool.lock);
+
+    context_reset(pool.base);
+  }
+
+  return NULL;
+}
+
+static void jobs_run(const char* const* const paths, const size_t count) {
+  /* Runs the files on top of ctx with worker_count workers */
+
+  // the workers run ctx's code but must never write to it
+  lazy_compile_all();
+  code_heap_executable();
+
+  pool.base = ctx;
+  pool.jobs = calloc(sizeof(*pool.jobs), count + 1);
+  pool.count = count;
+
+  for (size_t i = 0; i < count; ++i) {
+    pool.jobs[i].path = paths[i];
+  }
+
+  const size_t threads = worker_count < count ? worker_count : count;
+  pthread_t* const workers = calloc(sizeof(*workers), threads + 1);
+
+  for (size_t i = 0; i < threads; ++i) {
+    const int err = stack_thread_create(&workers[i], worker_main);
+
+    if (err != 0) {
+      error("Failed to start a worker thread: %s", strerror(err));
+    }
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    struct job* const job = &pool.jobs[i];
+
+    pthread_mutex_lock(&pool.lock);
+
+    while (!job->done) {
+      pthread_cond_wait(&pool.done, &pool.lock);
+    }
+
+    pthread_mutex_unlock(&pool.lock);
+
+    output_write(ctx->output, job->output, job->output_size);
+
+    if (job->failed) {
+      output_flush(ctx->output);
+      fwrite(job->errors, 1, job->errors_size, stderr);
+      exit(1);
+    }
+
+    free(job->output);
+    free(job->errors);
+  }
+
+  for (size_t i = 0; i < threads; ++i) {
+    pthread_join(workers[i], NULL);
+  }
+
+  free(workers);
+  free(pool.jobs);
+}
+
+/** Server **/
+
+/* With --serve, every file runs first as a prelude, and then connections to
+ * the address are served until the process is killed. Each connection runs
+ * in a context of its own on top of the prelude's, as a -j job would, and
+ * keeps it for as long as it stays open, so what one request defines the next
+ * one on the same connection can use. What it prints goes straight back down
+ * the connection, and an error is sent back the same way and closes it.
+ *
+ * Every server thread (-j of them, or just the main thread) has an epoll set
+ * of its own and takes new connections from the shared listening socket.
+ * Connections are non-blocking and each one runs as a coroutine on its own
+ * native stack, on the thread that accepted it: whenever it would block,
+ * partway through a form or not, it switches back to the thread's loop, and
+ * carries on where it was once its socket is ready. The compiler's
+ * per-thread state goes with it (see thread_state_swap), so connections can
+ * be stopped in the middle of a definition without getting in each other's
+ * way. Connections are reset and reused for later ones. */
+
+#define CONNECTION_STACK_SIZE (1024 * 1024)
+
+static const char* serve_address; // --serve
+
+static struct {
+  const struct context* base;
+  int listener;
+  struct vector idle; // of struct connection*, reset and ready for reuse
+  pthread_mutex_t lock;
+} server = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* What the compiler and error handling keep per thread, which a connection
+ * has to take with it when it lets another one run */
+struct thread_state {
+  sigjmp_buf* error_handler;
+  FILE* error_output;
+  const char* native_stack_low;
+  int record_call_sites;
+  struct regcache regcache;
+  struct vector ir_buffer, ir_blocks;
+  size_t ir_floor;
+  int compile_immediate, compile_quote_depth, compile_depth;
+  __typeof__(batch) batch;
+};
+
+struct connection {
+  struct context* context;
+  int fd;
+  short events; // what it's waiting for, POLLIN or POLLOUT
+  int done; // it's finished, and can be closed
+  ucontext_t coroutine;
+  char* native_stack; // CONNECTION_STACK_SIZE bytes above NATIVE_GUARD_SIZE of guard
+  struct thread_state state; // the thread's while it runs, its own otherwise
+};
+
+static __thread int server_epoll;
+static __thread ucontext_t server_loop; // what a connection switches back to
+static __thread struct connection* server_current; // the one running now
+
+#define THREAD_STATE_SWAP(STATE, NAME)           \
+  do {                                          \
+    const __typeof__(NAME) saved = NAME;        \
+    NAME = (STATE)->NAME;                       \
+    (STATE)->NAME = saved;                      \
+  } while (0)
+
+static void thread_state_swap(struct thread_state* const state) {
+  THREAD_STATE_SWAP(state, error_handler);
+  THREAD_STATE_SWAP(state, error_output);
+  THREAD_STATE_SWAP(state, native_stack_low);
+  THREAD_STATE_SWAP(state, record_call_sites);
+  THREAD_STATE_SWAP(state, regcache);
+  THREAD_STATE_SWAP(state, ir_buffer);
+  THREAD_STATE_SWAP(state, ir_blocks);
+  THREAD_STATE_SWAP(state, ir_floor);
+  THREAD_STATE_SWAP(state, compile_immediate);
+  THREAD_STATE_SWAP(state, compile_quote_depth);
+  THREAD_STATE_SWAP(state, compile_depth);
+  THREAD_STATE_SWAP(state, batch);
+}
+
+static int server_listen(const char* const address) {
+  /* Returns a non-blocking socket listening on address, which is unix:PATH,
+   * HOST:PORT or just PORT */
+
+  int fd = -1;
+
+  if (strncmp(address, "unix:", 5) == 0) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(address + 5) >= sizeof(addr.sun_path)) {
+      error("Socket path '%s' is too long", address + 5);
+    }
+
+    strcpy(addr.sun_path, address + 5);
+
+    // a socket left over from last time can go, but nothing else
+    struct stat st;
+
+    if (lstat(addr.sun_path, &st) == 0) {
+      if (!S_ISSOCK(st.st_mode)) {
+        error("Won't serve on '%s': it exists and isn't a socket", addr.sun_path);
+      }
+
+      unlink(addr.sun_path);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+      error("Failed to bind '%s': %s", address, strerror(errno));
+    }
+  } else {
+    const char* const colon = strrchr(address, ':');
+    char host[256] = "";
+
+    if (colon) {
+      if ((size_t)(colon - address) >= sizeof(host)) {
+        error("Host name in '%s' is too long", address);
+      }
+
+      memcpy(host, address, colon - address);
+      host[colon - address] = '\0';
+    }
+
+    const struct addrinfo hints = { .ai_flags = AI_PASSIVE, .ai_socktype = SOCK_STREAM };
+    struct addrinfo* found;
+
+    const int err = getaddrinfo(host[0] ? host : NULL, colon ? colon + 1 : address, &hints, &found);
+
+    if (err != 0) {
+      error("Bad address '%s': %s", address, gai_strerror(err));
+    }
+
+    for (const struct addrinfo* ai = found; ai; ai = ai->ai_next) {
+      fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+      if (fd < 0) {
+        continue;
+      }
+
+      const int one = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+      if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+        break;
+      }
+
+      close(fd);
+      fd = -1;
+    }
+
+    freeaddrinfo(found);
+
+    if (fd < 0) {
+      error("Failed to bind '%s': %s", address, strerror(errno));
     }
+  }
 
-    error("Encountered character with no properties '%c' (%d)", character, character);
+  if (listen(fd, SOMAXCONN) != 0 || fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+    error("Failed to listen on '%s': %s", address, strerror(errno));
   }
 
-  stack_push(&stack, stream);
-  stack_push(&stack, (void*)(uintptr_t)character);
+  return fd;
+}
 
-  call_guest_function(handler, &stack);
+static void server_watch(const int fd, const int op, const short events, void* const data) {
+  /* Has this thread pick up data once fd is ready for events */
 
-  return return_to_guest(stack);
+  struct epoll_event event = {
+    .events = (events == POLLOUT ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT,
+    .data.ptr = data,
+  };
+
+  if (epoll_ctl(server_epoll, op, fd, &event) != 0) {
+    error("Failed to watch a connection: %s", strerror(errno));
+  }
 }
 
-/** Compiler **/
+static int input_waiting(struct input_source* const src) {
+  /* Returns nonzero if reading from src wouldn't block, skipping whitespace
+   * that's already been read so that a trailing newline doesn't count */
 
-static GUESTFUNC(compile, stack) {
-  union rd_any* const rdobj = stack_pop(&stack);
+  while (src->pos < src->len
+         && (ctx->readtable->char_properties[toupper(src->data[src->pos])] & cprop_whitespace))
+  {
+    ++src->pos;
+  }
 
-  void* ret = NULL;
+  if (src->pos < src->len || src->saved_data || src->eof) {
+    return 1;
+  }
 
-  switch (rdobj->base.type) {
-  case rd_type_symbol:
-    {
-      struct symtab* const obj = symtab_lookup_symbol(*global_symbol_table, rdobj->sym.repr);
+  char byte;
+  const ssize_t got = recv(src->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
 
-      if (!obj) {
-        error("The name '%s' is undefined", rdobj->sym.repr);
-      }
+  // end of input and errors are for the reader to find
+  return got >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+}
 
-      switch (obj->symbol_type) {
-      case symtype_function:
-        ret = *program_area_ptr;
-        *program_area_ptr = asm_call(*program_area_ptr, obj->symbol_value);
-        break;
-      case symtype_macro:
-        call_guest_function(obj->symbol_value, &stack);
-        break;
-      case symtype_value:
-        ret = *program_area_ptr;
-        *program_area_ptr = asm_integer(*program_area_ptr, (intptr_t)obj->symbol_value);
-        break;
-      default:
-        error("Bug");
-      }
-    }
-    break;
-  case rd_type_number:
-    ret = *program_area_ptr;
-    *program_area_ptr = asm_integer(*program_area_ptr, rdobj->num.value);
-    break;
-  case rd_type_string:
-    ret = *program_area_ptr;
-    *program_area_ptr = asm_integer(*program_area_ptr, (intptr_t)rdobj->str.contents);
-    break;
-  case rd_type_quote:
-  case rd_type_cons:
-    error("unimplemented");
-  }
+static void connection_wait(const int fd, const short events) {
+  /* Switches back to the thread's loop until fd is ready; see fd_wait */
 
-  stack_push(&stack, ret);
+  struct connection* const conn = server_current;
 
-  return return_to_guest(stack);
+  conn->events = events;
+  swapcontext(&conn->coroutine, &server_loop);
 }
 
-/** Evaluator **/
+static void connection_main(void) {
+  /* The body of a connection's coroutine. It never returns: once the
+   * connection is finished it switches back for the last time. */
 
-static GUESTFUNC(eval, stack) {
-  /* eval: obj -> ?  
+  struct connection* const conn = server_current;
+  void** stack = ctx->stack_top;
 
-     The eval() function doesn't modify the stack in its own right,
-     but simply evaluates its argument and leaves its results on the
-     stack.
-  */
+  char* errors_text = NULL;
+  size_t errors_size = 0;
+  FILE* const errors = open_memstream(&errors_text, &errors_size);
 
-  union rd_any* const rdobj = stack_pop(&stack);
+  if (!errors) {
+    error("Failed to collect the errors of a connection: %s", strerror(errno));
+  }
 
-  switch (rdobj->base.type) {
-  case rd_type_symbol:
-    {
-      struct symtab* const obj = symtab_lookup_symbol(*global_symbol_table, rdobj->sym.repr);
+  sigjmp_buf handler;
 
-      if (!obj) {
-        error("The name '%s' is undefined", rdobj->sym.repr);
+  error_output = errors;
+  error_handler = &handler;
+
+  if (sigsetjmp(handler, 1) == 0) {
+    while (1) {
+      // the client is waiting to see what its last request did
+      if (!input_waiting(ctx->input)) {
+        batch_flush(&stack);
+        output_flush(ctx->output);
       }
 
-      switch (obj->symbol_type) {
-      case symtype_macro:
-      case symtype_function:
-        call_guest_function(obj->symbol_value, &stack);
-        break;
-      case symtype_value:
-        stack_push(&stack, obj->symbol_value);
+      if (!run_form(&stack)) {
         break;
       }
     }
-    break;
-  case rd_type_number:
-    stack_push(&stack, (void*)rdobj->num.value);
-    break;
-  case rd_type_string:
-    stack_push(&stack, (void*)rdobj->str.contents);
-    break;
-  case rd_type_quote:
-  case rd_type_cons:
-    error("unimplemented");
+
+    batch_flush(&stack);
+    output_flush(ctx->output);
+  } else {
+    compiler_reset();
   }
 
-  return return_to_guest(stack);
-}
+  error_handler = NULL;
+  error_output = NULL;
 
-/** Some intrinsics **/
+  fclose(errors);
 
-static GUESTFUNC(dup, stack) {
-  void* const value = *stack;
-  stack_push(&stack, value);
-  return return_to_guest(stack);
-}
+  // best effort, since the client may already be gone
+  if (errors_size > 0) {
+    send(conn->fd, errors_text, errors_size, MSG_NOSIGNAL);
+  }
 
-static GUESTFUNC(swap, stack) {
-  void* const value0 = stack[0];
-  void* const value1 = stack[1];
-  stack[1] = value0;
-  stack[0] = value1;
-  return return_to_guest(stack);
-}
+  free(errors_text);
 
-static GUESTFUNC(mult, stack) {
-  const long a = (long)stack_pop(&stack),
-             b = (long)stack_pop(&stack);
-  
-  stack_push(&stack, (void*)(a * b));
-  return return_to_guest(stack);
+  conn->done = 1;
+  swapcontext(&conn->coroutine, &server_loop);
 }
 
-static GUESTFUNC(add, stack) {
-  const long a = (long)stack_pop(&stack),
-             b = (long)stack_pop(&stack);
-  
-  stack_push(&stack, (void*)(a + b));
-  return return_to_guest(stack);
-}
+static struct connection* connection_open(const int fd) {
+  /* Makes a connection for fd, reusing one that's closed if there is one */
 
-static GUESTFUNC(subtract, stack) {
-  const long a = (long)stack_pop(&stack),
-             b = (long)stack_pop(&stack);
-  
-  stack_push(&stack, (void*)(b - a));
-  return return_to_guest(stack);
-}
+  struct connection* conn = NULL;
 
-static GUESTFUNC(print_int, stack) {
-  const long a = (long)stack_pop(&stack);
+  pthread_mutex_lock(&server.lock);
 
-  printf("%ld\n", a);
-  
-  return return_to_guest(stack);
-}
+  if (vector_length(&server.idle) > 0) {
+    server.idle.fill -= sizeof(conn);
+    conn = VECTOR_AT(&server.idle, struct connection*, vector_length(&server.idle) / sizeof(conn));
+  }
 
-static GUESTFUNC(print_string, stack) {
-  const char* const s = stack_pop(&stack);
+  pthread_mutex_unlock(&server.lock);
 
-  puts(s);
-  
-  return return_to_guest(stack);
-}
+  if (!conn) {
+    conn = calloc(sizeof(*conn), 1);
 
-static GUESTFUNC(read_ptr, stack) {
-  void** const ptr = stack_pop(&stack);
-  stack_push(&stack, *ptr);
-  
-  return return_to_guest(stack);
-}
+    if (!conn) {
+      error("Failed to allocate a connection");
+    }
 
-static GUESTFUNC(write_ptr, stack) {
-  void* const value = stack_pop(&stack);
-  void** const ptr = stack_pop(&stack);
+    conn->native_stack = mmap(NULL, CONNECTION_STACK_SIZE + NATIVE_GUARD_SIZE, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
 
-  *ptr = value;
+    if (conn->native_stack == MAP_FAILED
+        || mprotect(conn->native_stack, NATIVE_GUARD_SIZE, PROT_NONE) != 0)
+    {
+      error("Failed to allocate a connection's stack: %s", strerror(errno));
+    }
+
+    conn->native_stack += NATIVE_GUARD_SIZE;
+    conn->context = context_new(server.base);
+  }
+
+  // running out of native stack is an error on the connection, like any other
+  const struct thread_state fresh = {
+    .native_stack_low = conn->native_stack,
+    .record_call_sites = 1,
+  };
+
+  conn->fd = fd;
+  conn->events = POLLIN;
+  conn->done = 0;
+  conn->state = fresh;
+  conn->context->input = input_open_fd(fd);
+  conn->context->output = output_new(fd);
+
+  if (getcontext(&conn->coroutine) != 0) {
+    error("Failed to start a connection: %s", strerror(errno));
+  }
 
-  return return_to_guest(stack);
+  conn->coroutine.uc_stack.ss_sp = conn->native_stack;
+  conn->coroutine.uc_stack.ss_size = CONNECTION_STACK_SIZE;
+  conn->coroutine.uc_link = NULL;
+  makecontext(&conn->coroutine, connection_main, 0);
+
+  return conn;
 }
 
-static GUESTFUNC(allocatemem, stack) {
-  const long amt = (long)stack_pop(&stack);
+static void connection_close(struct connection* const conn) {
+  input_close(ctx->input);
+  ctx->input = NULL;
 
-  stack_push(&stack, malloc(amt));
+  output_delete(ctx->output);
+  ctx->output = NULL;
 
-  return return_to_guest(stack);
+  context_reset(server.base);
+
+  vector_delete(&conn->state.ir_buffer);
+  vector_delete(&conn->state.ir_blocks);
+
+  pthread_mutex_lock(&server.lock);
+  VECTOR_APPEND(&server.idle, struct connection*, conn);
+  pthread_mutex_unlock(&server.lock);
 }
 
-static void define_thing(void** stack, const enum symbol_type thing_type) {
-  stack_push(&stack, input);
+static void connection_resume(struct connection* const conn) {
+  /* Runs conn until it has to wait or it's finished */
 
-  call_guest_function(read, &stack);
+  context_enter(conn->context);
 
-  const union rd_any* const defname = stack_pop(&stack);
+  server_current = conn;
+  fd_waiter = connection_wait;
+  thread_state_swap(&conn->state);
 
-  if (defname->base.type != rd_type_symbol) {
-    error("Definition name must be a symbol");
-  }
+  swapcontext(&server_loop, &conn->coroutine);
 
-  void* const func = *program_area_ptr;
+  thread_state_swap(&conn->state);
+  fd_waiter = NULL;
+  server_current = NULL;
 
-  if (thing_type != symtype_value) {
-    ADD_SYM(defname->sym.repr, func, thing_type);
+  if (conn->done) {
+    connection_close(conn);
+  } else {
+    server_watch(conn->fd, EPOLL_CTL_MOD, conn->events, conn);
   }
+}
 
-  *program_area_ptr = asm_prologue(*program_area_ptr);
-
+static void server_accept(void) {
   while (1) {
-    stack_push(&stack, input);
+    const int fd = accept(server.listener, NULL, NULL);
 
-    call_guest_function(read, &stack);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
 
-    union rd_any* const obj = stack_pop(&stack);
+      // another thread may have got there first
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        fprintf(stderr, "Failed to accept a connection: %s\n", strerror(errno));
+      }
 
-    if (obj->base.type == rd_type_symbol && strcmp(obj->sym.repr, "DONE") == 0) {
       break;
     }
 
-    stack_push(&stack, obj);
-
-    if (thing_type == symtype_value) {
-      call_guest_function(eval, &stack);
-    } else {
-      call_guest_function(compile, &stack);
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+      fprintf(stderr, "Failed to set up a connection: %s\n", strerror(errno));
+      close(fd);
+      continue;
     }
+
+    // replies are small and the client is waiting for them
+    const int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    server_watch(fd, EPOLL_CTL_ADD, POLLIN, connection_open(fd));
   }
+}
 
-  if (thing_type == symtype_value) {
-    void* const val = stack_pop(&stack);
-    ADD_SYM(defname->sym.repr, val, symtype_value);
+static void* server_main(void* const arg) {
+  server_epoll = epoll_create1(0);
+
+  if (server_epoll < 0) {
+    error("Failed to create an epoll set: %s", strerror(errno));
   }
 
-  *program_area_ptr = asm_epilogue(*program_area_ptr);
-  *program_area_ptr = asm_ret(*program_area_ptr);
-}
+  // only one of the threads waiting on the listener is woken for each
+  // connection
+  struct epoll_event event = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
 
-static GUESTFUNC(defun, stack) {
-  define_thing(stack, symtype_function);
+  if (epoll_ctl(server_epoll, EPOLL_CTL_ADD, server.listener, &event) != 0) {
+    error("Failed to watch the listening socket: %s", strerror(errno));
+  }
 
-  return return_to_guest(stack);
-}
+  while (1) {
+    const int n = epoll_wait(server_epoll, &event, 1, -1);
 
-static GUESTFUNC(defmacro, stack) {
-  define_thing(stack, symtype_macro);
+    if (n < 0 && errno != EINTR) {
+      error("Failed to wait for connections: %s", strerror(errno));
+    }
 
-  return return_to_guest(stack);
-}
+    if (n <= 0) {
+      continue;
+    }
 
-static GUESTFUNC(defval, stack) {
-  define_thing(stack, symtype_value);
+    if (event.data.ptr) {
+      connection_resume(event.data.ptr);
+    } else {
+      server_accept();
+    }
+  }
 
-  return return_to_guest(stack);
+  return NULL;
 }
 
-/* The default readtable, which is immutable */
+static void serve(const char* const address) {
+  /* Serves connections to address on top of ctx; never returns */
 
-static const struct readtable default_readtable = {
-  { // char_properties
-    ['a' ... 'z'] = cprop_constituent,
-    ['A' ... 'Z'] = cprop_constituent,
-    ['_']         = cprop_constituent,
-    ['!']         = cprop_constituent,
-    ['@']         = cprop_constituent,
-    ['#']         = cprop_constituent,
-    ['$']         = cprop_constituent,
-    ['%']         = cprop_constituent,
-    ['^']         = cprop_constituent,
-    ['&']         = cprop_constituent,
-    ['*']         = cprop_constituent,
-    [':']         = cprop_constituent,
-    [',']         = cprop_constituent,
-    ['.']         = cprop_constituent,
-    ['<']         = cprop_constituent,
-    ['>']         = cprop_constituent,
-    ['=']         = cprop_constituent,
-    ['/']         = cprop_constituent,
-    ['?']         = cprop_constituent,
-    [';']         = cprop_constituent,
+  // the connections run ctx's code but must never write to it
+  lazy_compile_all();
+  code_heap_executable();
 
-    ['-']         = cprop_number_init | cprop_constituent,
-    ['+']         = cprop_number_init | cprop_constituent,
-    ['0' ... '9'] = cprop_number_init | cprop_number | cprop_constituent,
+  // a client hanging up shows up as a failed write instead
+  signal(SIGPIPE, SIG_IGN);
 
-    ['"']         = cprop_macro,
-    ['[']         = cprop_macro,
-    [']']         = cprop_error,
-    ['(']         = cprop_macro,
-    [')']         = cprop_error,
+  server.base = ctx;
+  server.listener = server_listen(address);
 
-    [' ']         = cprop_whitespace,
-    ['\n']        = cprop_whitespace,
-    ['\t']        = cprop_whitespace,
-    ['\r']        = cprop_whitespace,
-  },
-  
-  { // macro_dispatch
-    ['"']         = read_string,
-    ['[']         = read_quote,
-    [']']         = read_error,
-    ['(']         = read_list,
-    [')']         = read_error,
+  for (size_t i = 1; i < worker_count; ++i) {
+    pthread_t thread;
+    const int err = stack_thread_create(&thread, server_main);
+
+    if (err != 0) {
+      error("Failed to start a server thread: %s", strerror(err));
+    }
   }
-};
 
-int main(const int argc, const char* const argv[const]) {
-  /* Create globals accessible from the guest */
+  server_main(NULL);
+}
 
-  global_symbol_table = calloc(sizeof(*global_symbol_table), 1);
-  *global_symbol_table = SYMTAB_EMPTY;
+/* Command line options */
 
-  input = calloc(sizeof(*input), 1);
-  output = calloc(sizeof(*input), 1);
+static const char* save_image_path; // --save-image, saved after the last file
+static const char* load_image_path; // --load-image
 
-  *output = stdout;
+static size_t parse_count(const char* const str) {
+  char* end;
+  const unsigned long value = strtoul(str, &end, 10);
 
-  current_readtable = calloc(sizeof(*current_readtable), 1);
-  *current_readtable = calloc(sizeof(**current_readtable), 1);
-  **current_readtable = default_readtable;
+  if (end == str || *end != '\0' || value == 0) {
+    error("Invalid count '%s'", str);
+  }
 
-  /** Create page-aligned program area and set memory protections such
-   ** that it's executable (DEP is for weenies) **/
+  return value;
+}
 
-#define PAGE_SIZE 4096ULL
-#define PROGRAM_AREA_SIZE (PAGE_SIZE * 128ULL) // 128 * 4K = .5 mb
+static int is_option(const char* const arg) {
+  /* Options are anything starting with "--"; "-" on its own means stdin */
+  return arg[0] == '-' && arg[1] == '-';
+}
 
-  unsigned char* program_area = calloc(PROGRAM_AREA_SIZE + PAGE_SIZE, 1);
-  memset(program_area, 0xcc, PROGRAM_AREA_SIZE + PAGE_SIZE);
+static size_t parse_size(const char* const str) {
+  /* Parses a byte count with an optional K, M or G suffix */
 
-  // mprotect wants a page-aligned pointer
-  program_area = (void*)(((uintptr_t)program_area + PAGE_SIZE) & ~4095ULL);
+  char* end;
+  const unsigned long long value = strtoull(str, &end, 10);
 
-  mprotect(program_area, PROGRAM_AREA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC);
+  unsigned long long scale = 1;
 
-  program_area_ptr = malloc(sizeof(*program_area_ptr));
-  *program_area_ptr = program_area;
+  switch (toupper((unsigned char)*end)) {
+  case 'G': scale <<= 10; // fallthrough
+  case 'M': scale <<= 10; // fallthrough
+  case 'K': scale <<= 10; ++end; break;
+  }
 
-  /* Register globals */
+  if (end == str || *end != '\0' || value == 0) {
+    error("Invalid size '%s'", str);
+  }
 
-  ADD_SYM("*SYMTAB*", global_symbol_table, symtype_value);
-  ADD_SYM("*READTAB*", current_readtable, symtype_value);
-  ADD_SYM("*IN*", input, symtype_value);
-  ADD_SYM("*OUT*", output, symtype_value);
-  ADD_SYM("*PROGRAM*", program_area_ptr, symtype_value);
+  return value * scale;
+}
 
-  ADD_SYM("EOF", 0xffffffffffffffffULL, symtype_value);
-  ADD_SYM("READ", read, symtype_function);
-  ADD_SYM("READ-CHAR", read_char, symtype_function);
-  ADD_SYM("UNREAD-CHAR", unread_char, symtype_function);
-  ADD_SYM("EVAL", eval, symtype_function);
+static void parse_option(const char* const arg) {
+  if (strcmp(arg, "--no-regcache") == 0) {
+    regcache_enabled = 0;
+  } else if (strcmp(arg, "--no-peephole") == 0) {
+    peephole_enabled = 0;
+  } else if (strcmp(arg, "--no-simd") == 0) {
+    simd_enabled = 0;
+  } else if (strncmp(arg, "--save-image=", 13) == 0) {
+    save_image_path = arg + 13;
+  } else if (strncmp(arg, "--load-image=", 13) == 0) {
+    load_image_path = arg + 13;
+  } else if (strncmp(arg, "--serve=", 8) == 0) {
+    serve_address = arg + 8;
+  } else if (strcmp(arg, "--perf-map") == 0) {
+    perf_map_enabled = 1;
+  } else if (strcmp(arg, "--jitdump") == 0) {
+    jitdump_enabled = 1;
+  } else if (strcmp(arg, "--memstats") == 0) {
+    memstats_at_exit = 1;
+  } else if (strcmp(arg, "--profile") == 0) {
+    profile_enabled = 1;
+  } else if (strncmp(arg, "--stack-size=", 13) == 0) {
+    stack_size = parse_size(arg + 13);
+  } else if (strcmp(arg, "--batch") == 0) {
+    batch_enabled = 1;
+  } else if (strcmp(arg, "--lazy") == 0) {
+    lazy_enabled = 1;
+  } else if (strcmp(arg, "--wx") == 0) {
+    code_heap.wx = 1;
+  } else if (strcmp(arg, "--huge-pages") == 0) {
+    code_heap.huge_pages = 1;
+  } else if (strncmp(arg, "--code-heap=", 12) == 0) {
+    code_heap.size = (parse_size(arg + 12) + CODE_HEAP_CHUNK_SIZE - 1) & ~(CODE_HEAP_CHUNK_SIZE - 1);
+  } else {
+    error("Unknown option '%s'", arg);
+  }
+}
+
+static void register_globals(void) {
+  ADD_SYM("*SYMTAB*", global_symtab, symtype_function);
+  ADD_SYM("*READTAB*", global_readtab, symtype_function);
+  ADD_SYM("*IN*", global_in, symtype_function);
+  ADD_SYM("*OUT*", global_out, symtype_function);
+  ADD_SYM("*PROGRAM*", global_program, symtype_function);
 
-  ADD_SYM("SWAP", swap, symtype_function);
-  ADD_SYM("DUP", dup, symtype_function);
-  ADD_SYM("*", mult, symtype_function);
-  ADD_SYM("+", add, symtype_function);
-  ADD_SYM("-", subtract, symtype_function);
+  ADD_SYM("EOF", 0xffffffffffffffffULL, symtype_value);
+  ADD_IMMEDIATE("READ", read_form);
+  ADD_IMMEDIATE("READ-CHAR", read_char);
+  ADD_IMMEDIATE("UNREAD-CHAR", unread_char);
+  ADD_IMMEDIATE("EVAL", eval);
+
+  ADD_SYM("DROP", &inline_drop, symtype_inline);
+  ADD_SYM("SWAP", &inline_swap, symtype_inline);
+  ADD_SYM("DUP", &inline_dup, symtype_inline);
+  ADD_SYM("*", &inline_mult, symtype_inline);
+  ADD_SYM("+", &inline_add, symtype_inline);
+  ADD_SYM("-", &inline_subtract, symtype_inline);
 
   ADD_SYM("PRINTI", print_int, symtype_function);
   ADD_SYM("PRINTS", print_string, symtype_function);
+  ADD_SYM("FLUSH", flush, symtype_function);
+  ADD_SYM("FD-OUT", fd_out, symtype_function);
+  ADD_SYM("FILE-OUT", file_out, symtype_function);
+  ADD_SYM("CLOSE-OUT", close_out, symtype_function);
+
+  ADD_SYM("CALL", quote_call, symtype_function);
+  ADD_SYM("IF", quote_if, symtype_function);
+  ADD_SYM("TIMES", quote_times, symtype_function);
+  ADD_SYM("WHILE", quote_while, symtype_function);
 
-  ADD_SYM("DEFUN", defun, symtype_function);
-  ADD_SYM("DEFMACRO", defmacro, symtype_function);
-  ADD_SYM("DEFVAL", defval, symtype_function);
+  ADD_SYM("RDTSC", read_tsc, symtype_function);
+  ADD_SYM("NOW", now, symtype_function);
+  ADD_SYM("BENCH", bench, symtype_function);
+
+  ADD_IMMEDIATE("DEFUN", defun);
+  ADD_IMMEDIATE("DEFMACRO", defmacro);
+  ADD_IMMEDIATE("DEFVAL", defval);
 
   ADD_SYM("PTRSIZE", sizeof(void*), symtype_value);
   ADD_SYM("ALLOC", allocatemem, symtype_function);
-  ADD_SYM("PSET", write_ptr, symtype_function);
+  ADD_IMMEDIATE("PSET", write_ptr);
   ADD_SYM("PGET", read_ptr, symtype_function);
 
-  /* Create stack */
-
-  void** guest_stack_base, ** guest_stack;
-  stack_new(&guest_stack_base, &guest_stack, 1000); // this size seems legit
+  ADD_SYM("REGION", region_new, symtype_function);
+  ADD_SYM("REGION-ALLOC", region_alloc, symtype_function);
+  ADD_SYM("REGION-RESET", region_reset, symtype_function);
+  ADD_SYM("REGION-FREE", region_free, symtype_function);
+  ADD_IMMEDIATE("MEMCPY", mem_copy);
+  ADD_IMMEDIATE("MEMSET", mem_set);
+  ADD_IMMEDIATE("FILL", mem_fill);
+
+  ADD_IMMEDIATE("SAVE-IMAGE", save_image);
+  ADD_SYM("PROFILE-REPORT", profile_report, symtype_function);
+  ADD_SYM("MEMSTATS", memstats_report, symtype_function);
+}
 
-  /* Main program */
+int main(const int argc, const char* const argv[const]) {
+  const char** const files = calloc(sizeof(*files), argc);
+  size_t file_count = 0;
 
   for (int i = 1; i < argc; ++i) {
-    if (strcmp(argv[i], "-") == 0) {
-      *input = stdin;
+    if (strncmp(argv[i], "-j", 2) == 0) {
+      // -j N or -jN
+      worker_count = parse_count(argv[i][2] ? argv[i] + 2 : i + 1 < argc ? argv[++i] : "");
+    } else if (is_option(argv[i])) {
+      parse_option(argv[i]);
     } else {
-      *input = fopen(argv[i], "rb");
+      files[file_count++] = argv[i];
     }
+  }
 
-    if (!*input) {
-      error("Could not open file '%s'", argv[i]);
-    }
+  /* Create the root context. It's static so that the addresses of its
+   * fields, which can get compiled into code, can be relocated in images. */
 
-    struct rd_object* obj;
+  static struct context root_context;
+  static struct readtable root_readtable;
 
-    while (1) {
-      stack_push(&guest_stack, input);
+  context_init(&root_context, &root_readtable, NULL);
+  context_enter(&root_context);
 
-      call_guest_function(read, &guest_stack);
+  atexit(outputs_flush);
 
-      obj = stack_pop(&guest_stack);
+  if (memstats_at_exit) {
+    atexit(memstats_exit);
+  }
 
-      if (!obj) {
-        break;
-      }
+  simd_init();
 
-      stack_push(&guest_stack, obj);
+  perf_init();
 
-      call_guest_function(eval, &guest_stack);
-    }
+  /* Create the code heap and register globals, or load them */
+
+  if (load_image_path) {
+    image_load(load_image_path);
+  } else {
+    code_heap_init();
+    register_globals();
+  }
+
+  void** guest_stack = ctx->stack_top;
+
+  /* Main program */
+
+  // with -j only the prelude runs here, unless everything is the prelude
+  const size_t here = worker_count && !serve_address ? (file_count > 0) : file_count;
+
+  for (size_t i = 0; i < here; ++i) {
+    run_file(files[i], &guest_stack);
+  }
+
+  if (file_count > here) {
+    jobs_run(files + here, file_count - here);
+  }
+
+  if (save_image_path) {
+    image_save(save_image_path);
+  }
 
-    fclose(*input);
-    *input = NULL;
+  if (serve_address) {
+    serve(serve_address);
   }
 
   return 0;
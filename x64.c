@@ -1,21 +1,109 @@
 
-//#include "asm.h"
+#include "asm.h"
 
 #include <stdlib.h>
 #include <stdint.h>
 
+/* Guest functions are ordinary C functions of type void** (*)(void**): they
+ * take the data stack pointer in rdi and return the new one in rax, so C
+ * intrinsics need no glue. Inside generated code the stack pointer instead
+ * lives in rbx, which is callee-saved, so it survives calls to C without
+ * being spilled. asm_prologue and asm_epilogue are the trampolines between
+ * the two, and asm_guest_call/asm_guest_return are the glue around a call. */
+
 void* asm_prologue(void* const pgm) {
-  /* we have to do this because the stack has to be aligned to a
-     16-byte boundary, so the CALL instructions in our body will
-     misalign it unless we align it to 8 here */
-  *(uint32_t*)pgm = 0x08ec8348U; // subq rsp, 8
-  return (char*)pgm + 4;
+  /* pushing rbx also realigns the native stack to 16 bytes for the CALL
+     instructions in our body */
+  uint8_t* pgmc = pgm;
+
+  *pgmc++ = 0x53; // pushq rbx
+  *pgmc++ = 0x48; // movq rbx, rdi
+  *pgmc++ = 0x89;
+  *pgmc++ = 0xfb;
+
+  return pgmc;
+}
+
+void* asm_epilogue(void* const pgm, const int tail) {
+  /* Hands the stack back in rax for a return, or in rdi if the caller is
+     about to tail-jump to another guest function */
+  uint8_t* pgmc = pgm;
+
+  *pgmc++ = 0x48; // movq rax, rbx / movq rdi, rbx
+  *pgmc++ = 0x89;
+  *pgmc++ = tail ? 0xdf : 0xd8;
+  *pgmc++ = 0x5b; // popq rbx
+
+  return pgmc;
 }
 
-void* asm_epilogue(void* const pgm) {
-  /* now undo the alignment stuff we did in the prologue */
-  *(uint32_t*)pgm = 0x08c48348U; // addq rsp, 8
-  return (char*)pgm + 4;
+void* asm_guest_call(void* const pgm) {
+  /* Goes right before a call to a guest function */
+  uint8_t* pgmc = pgm;
+
+  *pgmc++ = 0x48; // movq rdi, rbx
+  *pgmc++ = 0x89;
+  *pgmc++ = 0xdf;
+
+  return pgmc;
+}
+
+void* asm_guest_return(void* const pgm) {
+  /* Goes right after a call to a guest function */
+  uint8_t* pgmc = pgm;
+
+  *pgmc++ = 0x48; // movq rbx, rax
+  *pgmc++ = 0x89;
+  *pgmc++ = 0xc3;
+
+  return pgmc;
+}
+
+void* asm_profile_prologue(void* const pgm, uint64_t* const calls) {
+  /* Like asm_prologue, but also counts a call in *calls and leaves the time
+     stamp counter on the stack for asm_profile_epilogue */
+  uint8_t* pgmc = asm_prologue(pgm);
+
+  *pgmc++ = 0x0f; // rdtsc
+  *pgmc++ = 0x31;
+  *(uint32_t*)pgmc = 0x20e2c148U; pgmc += 4; // shlq rdx, 32
+  *pgmc++ = 0x48; // orq rax, rdx
+  *pgmc++ = 0x09;
+  *pgmc++ = 0xd0;
+  *pgmc++ = 0x50; // pushq rax twice, which keeps the stack aligned
+  *pgmc++ = 0x50;
+  *pgmc++ = 0x48; // movabsq rax, <64-bit immediate>
+  *pgmc++ = 0xb8;
+  *(uint64_t*)pgmc = (uint64_t)calls;
+  pgmc += 8;
+  *pgmc++ = 0x48; // incq [rax]
+  *pgmc++ = 0xff;
+  *pgmc++ = 0x00;
+
+  return pgmc;
+}
+
+void* asm_profile_epilogue(void* const pgm, uint64_t* const cycles, const int tail) {
+  /* Undoes asm_profile_prologue, adding the cycles since then to *cycles */
+  uint8_t* pgmc = pgm;
+
+  *pgmc++ = 0x0f; // rdtsc
+  *pgmc++ = 0x31;
+  *(uint32_t*)pgmc = 0x20e2c148U; pgmc += 4; // shlq rdx, 32
+  *pgmc++ = 0x48; // orq rax, rdx
+  *pgmc++ = 0x09;
+  *pgmc++ = 0xd0;
+  *(uint32_t*)pgmc = 0x24042b48U; pgmc += 4; // subq rax, [rsp]
+  *pgmc++ = 0x48; // movabsq rdx, <64-bit immediate>
+  *pgmc++ = 0xba;
+  *(uint64_t*)pgmc = (uint64_t)cycles;
+  pgmc += 8;
+  *pgmc++ = 0x48; // addq [rdx], rax
+  *pgmc++ = 0x01;
+  *pgmc++ = 0x02;
+  *(uint32_t*)pgmc = 0x10c48348U; pgmc += 4; // addq rsp, 16
+
+  return asm_epilogue(pgmc, tail);
 }
 
 static intptr_t intptrabs(const intptr_t x) {
@@ -23,69 +111,203 @@ static intptr_t intptrabs(const intptr_t x) {
   return x;
 }
 
-void* asm_call(void* const pgm, const void* const function) {
+static int rel32_reachable(const void* const from, const void* const to) {
+  return intptrabs((intptr_t)to - (intptr_t)from) < 0x7fffffe0ULL;
+}
+
+static void* asm_branch(void* const pgm,
+                        const void* const function,
+                        const uint8_t rel32_opcode,
+                        const uint8_t rcx_modrm)
+{
+  /* Emits a call or jump to function, picking the shortest form that can
+   * reach it. A NULL function gets the longest form so that it can be patched
+   * to point anywhere. */
+
   uint8_t* pgmc = pgm;
 
   if (function == NULL) {
     goto longest_jump;
-  } else if (intptrabs((intptr_t)function - (intptr_t)pgm) < 0x7fffffe0ULL) {
-    *pgmc++ = 0xe8; // callq <32-bit immediate offset>
+  } else if (rel32_reachable(pgm, function)) {
+    *pgmc++ = rel32_opcode; // callq/jmpq <32-bit immediate offset>
     *(uint32_t*)pgmc = ((uintptr_t)function - ((uintptr_t)pgmc + 4));
     pgmc += 4;
   } else if ((uintptr_t)function < 0xffffffff) {
     *pgmc++ = 0xb9; // mov ecx, <32-bit immediate>
     *(uint32_t*)pgmc = (uintptr_t)function;
     pgmc += 4;
-    *pgmc++ = 0xff; // call [rcx]
-    *pgmc++ = 0xd1;
+    *pgmc++ = 0xff; // callq/jmpq [rcx]
+    *pgmc++ = rcx_modrm;
   } else {
 longest_jump:
     *pgmc++ = 0x48; // movabsq rcx, <64-bit immediate>
     *pgmc++ = 0xb9;
     *(uint64_t*)pgmc = (uint64_t)function;
     pgmc += 8;
-    *pgmc++ = 0xff; // callq [rcx]
-    *pgmc++ = 0xd1;
+    *pgmc++ = 0xff; // callq/jmpq [rcx]
+    *pgmc++ = rcx_modrm;
   }
 
   return pgmc;
 }
 
+void* asm_call(void* const pgm, const void* const function) {
+  return asm_branch(pgm, function, 0xe8, 0xd1);
+}
+
+void* asm_jmp(void* const pgm, const void* const function) {
+  return asm_branch(pgm, function, 0xe9, 0xe1);
+}
+
 void* asm_ret(void* const pgm) {
   *(uint8_t*)pgm = 0xc3; // retq
   return (uint8_t*)pgm + 1;
 }
 
-void asm_patch_call(void* const call, const void* const function) {
-  *(uint64_t*)((uint8_t*)call + 2) = (uint64_t)function;
+int asm_patch_call(void* const call, const void* const function) {
+  /* Repoints a call or jump emitted by asm_call or asm_jmp. Returns zero if the
+   * form that was emitted can't reach function. */
+
+  uint8_t* const callc = call;
+
+  if (callc[0] == 0xe8 || callc[0] == 0xe9) {
+    if (!rel32_reachable(callc, function)) {
+      return 0;
+    }
+
+    *(uint32_t*)(callc + 1) = (uintptr_t)function - ((uintptr_t)callc + 5);
+  } else if (callc[0] == 0xb9) {
+    if ((uintptr_t)function >= 0xffffffff) {
+      return 0;
+    }
+
+    *(uint32_t*)(callc + 1) = (uintptr_t)function;
+  } else {
+    *(uint64_t*)(callc + 2) = (uint64_t)function;
+  }
+
+  return 1;
+}
+
+const void* asm_call_target(const void* const call) {
+  /* Returns where a call or jump emitted by asm_call or asm_jmp goes, or NULL
+   * if call doesn't point at one. Reads up to 12 bytes at call. */
+
+  const uint8_t* const callc = call;
+
+  if (callc[0] == 0xe8 || callc[0] == 0xe9) {
+    return callc + 5 + *(const int32_t*)(callc + 1);
+  }
+
+  if (callc[0] == 0xb9 && callc[5] == 0xff && (callc[6] == 0xd1 || callc[6] == 0xe1)) {
+    return (const void*)(uintptr_t)*(const uint32_t*)(callc + 1);
+  }
+
+  if (callc[0] == 0x48 && callc[1] == 0xb9 && callc[10] == 0xff && (callc[11] == 0xd1 || callc[11] == 0xe1)) {
+    return (const void*)(uintptr_t)*(const uint64_t*)(callc + 2);
+  }
+
+  return NULL;
+}
+
+void* asm_find_call(void* const return_address, const void* const function) {
+  /* If the instruction just before return_address is a call to function as
+   * emitted by asm_call, returns the address of the call. Otherwise NULL. The
+   * 12 bytes before return_address must be readable. */
+
+  uint8_t* const ret = return_address;
+
+  if (ret[-5] == 0xe8 && (uintptr_t)ret + *(int32_t*)(ret - 4) == (uintptr_t)function) {
+    return ret - 5;
+  }
+
+  if (ret[-2] == 0xff && ret[-1] == 0xd1) {
+    if (ret[-7] == 0xb9 && *(uint32_t*)(ret - 6) == (uintptr_t)function) {
+      return ret - 7;
+    }
+
+    if (ret[-12] == 0x48 && ret[-11] == 0xb9 && *(uint64_t*)(ret - 10) == (uint64_t)function) {
+      return ret - 12;
+    }
+  }
+
+  return NULL;
+}
+
+void* asm_veneer(void* const pgm, const void* const function) {
+  /* Emits a jump to function from anywhere, for calls and jumps that can't
+   * reach it with rel32 to go through instead. Always ASM_VENEER_SIZE bytes. */
+
+  uint8_t* pgmc = pgm;
+
+  *pgmc++ = 0xff; // jmpq [rip + 0]
+  *pgmc++ = 0x25;
+  *(uint32_t*)pgmc = 0;
+  pgmc += 4;
+  *(uint64_t*)pgmc = (uint64_t)function;
+
+  return pgmc + 8;
+}
+
+void* asm_resolver_stub(void* const pgm, const void* const context, const void* const resolver) {
+  /* Emits a stub that calls the C function resolver(context, return address of
+   * the stub's caller), and then jumps to whatever address resolver returns
+   * as if the caller had called that in the first place. */
+
+  uint8_t* pgmc = pgm;
+
+  *pgmc++ = 0x57; // pushq rdi, which also realigns the native stack
+  *(uint32_t*)pgmc = 0x24748b48U; pgmc += 4; // movq rsi, [rsp+8]
+  *pgmc++ = 0x08;
+  *pgmc++ = 0x48; // movabsq rdi, <64-bit immediate>
+  *pgmc++ = 0xbf;
+  *(uint64_t*)pgmc = (uint64_t)context;
+  pgmc += 8;
+  pgmc = asm_call(pgmc, resolver);
+  *pgmc++ = 0x5f; // popq rdi
+  *pgmc++ = 0xff; // jmpq rax
+  *pgmc++ = 0xe0;
+
+  return pgmc;
+}
+
+static int fits_simm32(const long l) {
+  return l >= INT32_MIN && l <= INT32_MAX;
 }
 
 void* asm_integer(void* const pgm, const long l) {
   uint8_t* pgmc = pgm;
   
-  *(uint32_t*)pgmc = 0x08ef8348U; pgmc += 4; // subq rdi, 8
+  *(uint32_t*)pgmc = 0x08eb8348U; pgmc += 4; // subq rbx, 8
+
+  if (fits_simm32(l)) {
+    *pgmc++ = 0x48; // movq [rbx], <sign-extended 32-bit immediate>
+    *pgmc++ = 0xc7;
+    *pgmc++ = 0x03;
+    *(int32_t*)pgmc = (int32_t)l;
+    return pgmc + 4;
+  }
+
   *pgmc++ = 0x48; // movabsq rcx, <64-bit immediate>
   *pgmc++ = 0xb9;
   *(uint64_t*)pgmc = l;
   pgmc += 8;
-  *(uint32_t*)pgmc = 0x000f8948U; pgmc += 3; // movq [rdi], rcx
+  *(uint32_t*)pgmc = 0x000b8948U; pgmc += 3; // movq [rbx], rcx
 
   return pgmc;
 }
 
-/*
-
 void* asm_pop(void* const pgm) {
-  *(uint32_t*)pgm = 0x08c78348U; // add rdi, 8
+  *(uint32_t*)pgm = 0x08c38348U; // addq rbx, 8
   return (uint8_t*)pgm + 4;
 }
 
 void* asm_dup(void* const pgm) {
   uint8_t* pgmc = pgm;
 
-  *(uint32_t*)pgmc = 0x08ef8348U; pgmc += 4; // subq rdi, 8
-  *(uint32_t*)pgmc = 0x084f8b48U; pgmc += 4; // movq rcx, [rdi+8]
-  *(uint32_t*)pgmc = 0x000f8948U; pgmc += 3; // movq [rdi], rcx and yes that's a 3
+  *(uint32_t*)pgmc = 0x08eb8348U; pgmc += 4; // subq rbx, 8
+  *(uint32_t*)pgmc = 0x084b8b48U; pgmc += 4; // movq rcx, [rbx+8]
+  *(uint32_t*)pgmc = 0x000b8948U; pgmc += 3; // movq [rbx], rcx and yes that's a 3
 
   return pgmc;
 }
@@ -93,44 +315,329 @@ void* asm_dup(void* const pgm) {
 void* asm_swap(void* const pgm) {
   uint8_t* pgmc = pgm;
 
-  *(uint32_t*)pgmc = 0x084f8b48U; pgmc += 4; // movq rcx, [rdi+8]
-  *(uint32_t*)pgmc = 0x00178b48U; pgmc += 3; // movq rdx, [rdi]
-  *(uint32_t*)pgmc = 0x000f8948U; pgmc += 3; // movq [rdi], rcx
-  *(uint32_t*)pgmc = 0x08578948U; pgmc += 4; // movq [rdi+8], rdx
+  *(uint32_t*)pgmc = 0x084b8b48U; pgmc += 4; // movq rcx, [rbx+8]
+  *(uint32_t*)pgmc = 0x00138b48U; pgmc += 3; // movq rdx, [rbx]
+  *(uint32_t*)pgmc = 0x000b8948U; pgmc += 3; // movq [rbx], rcx
+  *(uint32_t*)pgmc = 0x08538948U; pgmc += 4; // movq [rbx+8], rdx
 
   return pgmc;
 }
 
+/* The binary operators pop the top of the stack into rcx and then operate on
+ * the new top in place */
+
 void* asm_add(void* const pgm) {
   uint8_t* pgmc = pgm;
 
-  *(uint32_t*)pgmc = 0x084f8b48U; pgmc += 4; // movq rcx, [rdi+8]
-  *(uint32_t*)pgmc = 0x00178b48U; pgmc += 3; // movq rdx, [rdi]
-  *(uint32_t*)pgmc = 0x08c78348U; pgmc += 4; // add rdi, 8
-  *(uint32_t*)pgmc = 0x004801d1U; pgmc += 3; // add rcx, rdx
-  *(uint32_t*)pgmc = 0x000f8948U; pgmc += 3; // mov [rdi], rcx
+  *(uint32_t*)pgmc = 0x000b8b48U; pgmc += 3; // movq rcx, [rbx]
+  *(uint32_t*)pgmc = 0x08c38348U; pgmc += 4; // addq rbx, 8
+  *(uint32_t*)pgmc = 0x000b0148U; pgmc += 3; // addq [rbx], rcx
 
   return pgmc;
 }
 
-void* asm_sub(void* pgm) {
+void* asm_sub(void* const pgm) {
   uint8_t* pgmc = pgm;
 
-  *(uint32_t*)pgmc = 0x084f8b48U; pgmc += 4; // movq rcx, [rdi+8]
-  *(uint32_t*)pgmc = 0x00178b48U; pgmc += 3; // movq rdx, [rdi]
-  *(uint32_t*)pgmc = 0x08c78348U; pgmc += 4; // add rdi, 8
-  // *(uint32_t*)pgmc = 0xU; pgmc += 3; // sub rcx, rdx
-  *(uint32_t*)pgmc = 0x000f8948U; pgmc += 3; // mov [rdi], rcx
+  *(uint32_t*)pgmc = 0x000b8b48U; pgmc += 3; // movq rcx, [rbx]
+  *(uint32_t*)pgmc = 0x08c38348U; pgmc += 4; // addq rbx, 8
+  *(uint32_t*)pgmc = 0x000b2948U; pgmc += 3; // subq [rbx], rcx
 
   return pgmc;
 }
 
-void* asm_mul(void* pgm) {
-  
+void* asm_mul(void* const pgm) {
+  uint8_t* pgmc = pgm;
+
+  *(uint32_t*)pgmc = 0x000b8b48U; pgmc += 3; // movq rcx, [rbx]
+  *(uint32_t*)pgmc = 0x08c38348U; pgmc += 4; // addq rbx, 8
+  *(uint32_t*)pgmc = 0x0baf0f48U; pgmc += 4; // imulq rcx, [rbx]
+  *(uint32_t*)pgmc = 0x000b8948U; pgmc += 3; // movq [rbx], rcx
+
+  return pgmc;
 }
 
-void* asm_div(void* pgm) {
-  return ((int(*)())0x12345678U)();
+/* Register-level emitters for the compiler's register cache. Scratch
+ * registers are numbered from 0 to ASM_SCRATCH_REGISTERS - 1 and map onto
+ * caller-saved registers, so guest calls are free to clobber all of them.
+ * Stack slot n is the memory at [rbx + 8n]. */
+
+static const uint8_t scratch_registers[ASM_SCRATCH_REGISTERS] = {
+  0, // rax
+  2, // rdx
+  6, // rsi
+  8, // r8
+  9, // r9
+  10, // r10
+  11, // r11
+  1, // rcx
+};
+
+static uint8_t* asm_rex_modrm(uint8_t* pgmc,
+                              const uint8_t opcode,
+                              const uint8_t reg,
+                              const uint8_t rm)
+{
+  /* Emits a REX.W-prefixed instruction with a register-direct ModRM byte */
+
+  *pgmc++ = 0x48 | ((reg >> 3) << 2) | (rm >> 3); // REX.W, REX.R, REX.B
+  *pgmc++ = opcode;
+  *pgmc++ = 0xc0 | ((reg & 7) << 3) | (rm & 7);
+  return pgmc;
 }
 
-*/
+static uint8_t* asm_rex_slot(uint8_t* pgmc, const uint8_t opcode, const uint8_t reg, const int slot) {
+  /* Emits a REX.W-prefixed instruction whose memory operand is [rbx + 8 * slot] */
+
+  *pgmc++ = 0x48 | ((reg >> 3) << 2); // REX.W, REX.R
+  *pgmc++ = opcode;
+
+  if (slot == 0) {
+    *pgmc++ = ((reg & 7) << 3) | 3; // [rbx]
+  } else {
+    *pgmc++ = 0x40 | ((reg & 7) << 3) | 3; // [rbx + disp8]
+    *pgmc++ = (int8_t)(slot * 8);
+  }
+
+  return pgmc;
+}
+
+void* asm_reg_imm(void* const pgm, const int reg, const long l) {
+  /* Nothing lowered between instructions depends on the flags, so zeroing
+   * with xor is fine */
+  uint8_t* pgmc = pgm;
+  const uint8_t r = scratch_registers[reg];
+
+  if (l == 0) {
+    if (r >= 8) {
+      *pgmc++ = 0x45; // REX.R, REX.B
+    }
+
+    *pgmc++ = 0x31; // xorl reg, reg
+    *pgmc++ = 0xc0 | ((r & 7) << 3) | (r & 7);
+    return pgmc;
+  }
+
+  if (l > 0 && fits_simm32(l)) {
+    if (r >= 8) {
+      *pgmc++ = 0x41; // REX.B
+    }
+
+    *pgmc++ = 0xb8 | (r & 7); // movl reg, <32-bit immediate>, which zero-extends
+    *(int32_t*)pgmc = (int32_t)l;
+    return pgmc + 4;
+  }
+
+  if (fits_simm32(l)) {
+    *pgmc++ = 0x48 | (r >> 3); // movq reg, <sign-extended 32-bit immediate>
+    *pgmc++ = 0xc7;
+    *pgmc++ = 0xc0 | (r & 7);
+    *(int32_t*)pgmc = (int32_t)l;
+    return pgmc + 4;
+  }
+
+  *pgmc++ = 0x48 | (r >> 3); // movabsq reg, <64-bit immediate>
+  *pgmc++ = 0xb8 | (r & 7);
+  *(uint64_t*)pgmc = l;
+  pgmc += 8;
+
+  return pgmc;
+}
+
+void* asm_reg_mov(void* const pgm, const int dst, const int src) {
+  // movq dst, src
+  return asm_rex_modrm(pgm, 0x89, scratch_registers[src], scratch_registers[dst]);
+}
+
+void* asm_reg_load(void* const pgm, const int reg, const int slot) {
+  // movq reg, [rbx + 8 * slot]
+  return asm_rex_slot(pgm, 0x8b, scratch_registers[reg], slot);
+}
+
+void* asm_reg_store(void* const pgm, const int slot, const int reg) {
+  // movq [rbx + 8 * slot], reg
+  return asm_rex_slot(pgm, 0x89, scratch_registers[reg], slot);
+}
+
+void* asm_adjust(void* const pgm, const int slots) {
+  uint8_t* pgmc = pgm;
+
+  if (slots == 0) {
+    return pgmc;
+  }
+
+  *pgmc++ = 0x48;
+  *pgmc++ = 0x83;
+  *pgmc++ = slots > 0 ? 0xc3 : 0xeb; // addq rbx, <imm8> / subq rbx, <imm8>
+  *pgmc++ = (slots > 0 ? slots : -slots) * 8;
+
+  return pgmc;
+}
+
+void* asm_reg_add(void* const pgm, const int dst, const int src) {
+  // addq dst, src
+  return asm_rex_modrm(pgm, 0x01, scratch_registers[src], scratch_registers[dst]);
+}
+
+void* asm_reg_sub(void* const pgm, const int dst, const int src) {
+  // subq dst, src
+  return asm_rex_modrm(pgm, 0x29, scratch_registers[src], scratch_registers[dst]);
+}
+
+void* asm_reg_mul(void* const pgm, const int dst, const int src) {
+  uint8_t* pgmc = pgm;
+
+  *pgmc++ = 0x48 | ((scratch_registers[dst] >> 3) << 2) | (scratch_registers[src] >> 3);
+  *pgmc++ = 0x0f; // imulq dst, src
+  *pgmc++ = 0xaf;
+  *pgmc++ = 0xc0 | ((scratch_registers[dst] & 7) << 3) | (scratch_registers[src] & 7);
+
+  return pgmc;
+}
+
+/* Arithmetic with an immediate operand. The caller makes sure imm fits in a
+ * sign-extended 32-bit immediate. */
+
+static uint8_t* asm_imm(uint8_t* pgmc, const long imm, const int short_form) {
+  if (short_form) {
+    *pgmc++ = (int8_t)imm;
+  } else {
+    *(int32_t*)pgmc = (int32_t)imm;
+    pgmc += 4;
+  }
+
+  return pgmc;
+}
+
+static uint8_t* asm_group1_imm(uint8_t* pgmc, const uint8_t ext, const int reg, const long imm) {
+  /* Emits one of the 0x81/0x83 group 1 instructions, using the short immediate
+   * if imm fits in a byte. ext is the /digit that selects the operation. The
+   * operand is the scratch register reg, or [rbx] if reg is negative. */
+
+  const int short_form = imm >= -128 && imm <= 127;
+
+  if (reg < 0) {
+    *pgmc++ = 0x48; // REX.W
+    *pgmc++ = short_form ? 0x83 : 0x81;
+    *pgmc++ = (ext << 3) | 3; // [rbx]
+  } else {
+    const uint8_t r = scratch_registers[reg];
+
+    *pgmc++ = 0x48 | (r >> 3); // REX.W, REX.B
+    *pgmc++ = short_form ? 0x83 : 0x81;
+    *pgmc++ = 0xc0 | (ext << 3) | (r & 7);
+  }
+
+  return asm_imm(pgmc, imm, short_form);
+}
+
+void* asm_reg_add_imm(void* const pgm, const int reg, const long imm) {
+  return asm_group1_imm(pgm, 0, reg, imm); // addq reg, imm
+}
+
+void* asm_reg_sub_imm(void* const pgm, const int reg, const long imm) {
+  return asm_group1_imm(pgm, 5, reg, imm); // subq reg, imm
+}
+
+void* asm_add_imm(void* const pgm, const long imm) {
+  return asm_group1_imm(pgm, 0, -1, imm); // addq [rbx], imm
+}
+
+void* asm_sub_imm(void* const pgm, const long imm) {
+  return asm_group1_imm(pgm, 5, -1, imm); // subq [rbx], imm
+}
+
+void* asm_reg_mul_imm(void* const pgm, const int reg, const long imm) {
+  uint8_t* pgmc = pgm;
+  const uint8_t r = scratch_registers[reg];
+  const int short_form = imm >= -128 && imm <= 127;
+
+  *pgmc++ = 0x48 | ((r >> 3) << 2) | (r >> 3); // REX.W, REX.R, REX.B
+  *pgmc++ = short_form ? 0x6b : 0x69; // imulq reg, reg, imm
+  *pgmc++ = 0xc0 | ((r & 7) << 3) | (r & 7);
+
+  return asm_imm(pgmc, imm, short_form);
+}
+
+/* Branches within a definition, for compiled control flow. The forward ones
+ * are emitted with a zero offset and return the end of the branch, which is
+ * what asm_patch_jump takes to point them somewhere. Loops keep their count
+ * in r12, which is callee-saved so it survives calls in the body; the old
+ * value is saved on the native stack (twice, to keep it aligned) so that
+ * loops can nest. */
+
+static uint8_t* asm_test(uint8_t* pgmc, const int reg) {
+  const uint8_t r = scratch_registers[reg];
+
+  // testq reg, reg
+  return asm_rex_modrm(pgmc, 0x85, r, r);
+}
+
+static uint8_t* asm_jcc(uint8_t* pgmc, const uint8_t cc) {
+  *pgmc++ = 0x0f; // jcc <32-bit immediate offset>
+  *pgmc++ = cc;
+  *(uint32_t*)pgmc = 0;
+  return pgmc + 4;
+}
+
+void* asm_jump(void* const pgm) {
+  uint8_t* pgmc = pgm;
+
+  *pgmc++ = 0xe9; // jmpq <32-bit immediate offset>
+  *(uint32_t*)pgmc = 0;
+  return pgmc + 4;
+}
+
+void* asm_jump_if_zero(void* const pgm, const int reg) {
+  return asm_jcc(asm_test(pgm, reg), 0x84); // jz
+}
+
+void* asm_jump_if_nonzero(void* const pgm, const int reg) {
+  return asm_jcc(asm_test(pgm, reg), 0x85); // jnz
+}
+
+int asm_patch_jump(void* const end, const void* const target) {
+  /* Points the branch that ends at end to target. Returns zero if it can't
+   * reach. */
+
+  if (!rel32_reachable(end, target)) {
+    return 0;
+  }
+
+  *(int32_t*)((uint8_t*)end - 4) = (intptr_t)target - (intptr_t)end;
+  return 1;
+}
+
+void* asm_loop_start(void* const pgm, const int reg) {
+  /* Starts a loop that runs as many times as scratch register reg says */
+  uint8_t* pgmc = pgm;
+
+  *pgmc++ = 0x41; // pushq r12 twice
+  *pgmc++ = 0x54;
+  *pgmc++ = 0x41;
+  *pgmc++ = 0x54;
+
+  // movq r12, reg
+  return asm_rex_modrm(pgmc, 0x89, scratch_registers[reg], 12);
+}
+
+void* asm_loop_next(void* const pgm) {
+  /* Counts down, branching back to the top of the loop if there's more to do.
+   * A count that started out zero or negative ends the loop straight away. */
+  uint8_t* pgmc = pgm;
+
+  *(uint32_t*)pgmc = 0x01ec8349U; pgmc += 4; // subq r12, 1
+
+  return asm_jcc(pgmc, 0x8d); // jge
+}
+
+void* asm_loop_end(void* const pgm) {
+  uint8_t* pgmc = pgm;
+
+  *pgmc++ = 0x41; // popq r12 twice
+  *pgmc++ = 0x5c;
+  *pgmc++ = 0x41;
+  *pgmc++ = 0x5c;
+
+  return pgmc;
+}